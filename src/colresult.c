@@ -8,6 +8,56 @@
 #include <string.h>
 #include "colresult.h"
 
+// copy length bytes of a field value and NUL terminate them, since a
+// binary format value has an explicit length rather than a terminator
+static char* copyFieldValue(const char* value, int length)
+{
+    char* copy = malloc(length + 1);
+
+    memcpy(copy, value, length);
+    copy[length] = '\0';
+
+    return copy;
+}
+
+// allocate a PGColResult and populate it from one field of a query result
+PGColResult* newColResult(const PGresult* res, int row, int col)
+{
+    return newColResultFromField(res, col,
+                PQgetvalue(res, row, col),
+                PQgetlength(res, row, col),
+                (PQgetisnull(res, row, col) ? true: false));
+}
+
+// allocate a PGColResult with the column description of a query result
+// and a value that came from somewhere else, e.g. COPY ... TO STDOUT
+PGColResult* newColResultFromField(const PGresult* res, int col,
+                                   const char* value, int length, bool isnull)
+{
+    PGColResult* cr = malloc(sizeof(PGColResult));
+
+    cr->fname     = strdup(PQfname(res, col));
+    cr->fnumber   = PQfnumber(res, cr->fname);
+    cr->ftable    = PQftable(res, col);
+    cr->ftablecol = PQftablecol(res, col);
+    cr->fformat   = PQfformat(res, col);
+    cr->ftype     = PQftype(res, col);
+    cr->fmod      = PQfmod(res, col);
+    cr->fsize     = PQfsize(res, col);
+    cr->isnull    = isnull;
+    cr->length    = length;
+
+    // text, varchar and bpchar values in binary format are the raw bytes
+    // of the string, with no output function run on the server, so take
+    // the length as given.  anything else in text format is a C string
+    if (colResultIsBinaryString(cr))
+        cr->value = copyFieldValue(value, length);
+    else
+        cr->value = strdup(value);
+
+    return cr;
+}
+
 // deep copy of one PGColResult to another
 PGColResult* copyColResult(const PGColResult* const src, PGColResult* dest)
 {
@@ -23,7 +73,7 @@ PGColResult* copyColResult(const PGColResult* const src, PGColResult* dest)
     dest->fsize     = src->fsize;
     dest->isnull    = src->isnull;
     dest->length    = src->length;
-    dest->value     = strdup(src->value);
+    dest->value     = copyFieldValue(src->value, src->length);
 
     return dest;
 }
@@ -53,6 +103,13 @@ char* colResultSetValue(PGColResult* const cr, const char* value)
     return cr->value;
 }
 
+// true for a text, varchar or bpchar column read in binary format
+bool colResultIsBinaryString(const PGColResult* const cr)
+{
+    return (cr->fformat == 1 &&
+            (cr->ftype == TEXTOID || cr->ftype == VARCHAROID || cr->ftype == BPCHAROID));
+}
+
 // convenience function to see if a column is null
 // probably unnecessary encapsulation
 // this is what happens when you write too much C++
@@ -66,4 +123,26 @@ bool colResultIsNULL(const PGColResult* const cr)
 bool colResultIsEmptyString(const PGColResult* const cr)
 {
     return (cr->isnull == false && cr->length == 0);
-}
\ No newline at end of file
+}
+
+// true if two column results hold the same value, byte for byte.  two
+// NULLs are the same value, and a NULL is never the same as ''
+bool colResultValueEquals(const PGColResult* const a, const PGColResult* const b)
+{
+    if (a->isnull || b->isnull)
+        return (a->isnull == b->isnull);
+
+    return (a->length == b->length && memcmp(a->value, b->value, a->length) == 0);
+}
+
+// free a PGRowResult and the column results it holds
+void freeRowResult(PGRowResult* rr)
+{
+    free((void *) rr->ukValues);
+    free((void *) rr->ctid);
+    free((void *) rr->xmin);
+    free((void *) rr->rereadKey);
+    vector_free(&rr->ukTuple);
+    vector_free(&rr->cols);
+    free((void *) rr);
+}
@@ -12,6 +12,14 @@
 #include <stdlib.h>
 #include <stdbool.h>
 
+#include "vector.h"
+
+// pg_type oids of the character-based types read in binary format.  their
+// binary representation is the string's bytes, without a terminating NUL
+#define TEXTOID     25
+#define BPCHAROID   1042
+#define VARCHAROID  1043
+
 typedef struct
 {
     char*   fname;          // field name; NULL if column number is out of range
@@ -27,17 +35,37 @@ typedef struct
                             // empty string
     int     length;         // actual length of the field value in bytes.  semantics similar to strlen()
                             // NOT THE SAME THING AS FSIZE!!!
-    char*   value;          // column value as a char*
+    char*   value;          // column value as a char*; always NUL terminated, even in binary format
 } PGColResult;
 
+typedef struct
+{
+    char*   ukValues;       // unique key values as cast literals, e.g. '3'::integer, 'Hold'::text
+    Vector  ukTuple;        // unique key values as text, one char* per key column; NULL for SQL NULL
+    char*   ctid;           // heap tuple the row was read from, e.g. (12,3); NULL if not known
+    char*   xmin;           // transaction that wrote the row version read, e.g. 1234; NULL if not known
+    char*   rereadKey;      // under --scan=ctid, the table's unique key values as cast literals, to re-read
+                            // the row by once its ctid and xmin have changed; NULL if the table has none
+    Vector  cols;           // PGColResult* for each character-based column, in table order
+} PGRowResult;
+
 void freeColResult(PGColResult* cr);
 
+PGColResult* newColResult(const PGresult* res, int row, int col);
+
+PGColResult* newColResultFromField(const PGresult* res, int col,
+                                   const char* value, int length, bool isnull);
+
 PGColResult* copyColResult(const PGColResult* const src, PGColResult* dest);
 
+bool colResultIsBinaryString(const PGColResult* const cr);
 bool colResultIsNULL(const PGColResult* const cr);
 bool colResultIsEmptyString(const PGColResult* const cr);
+bool colResultValueEquals(const PGColResult* const a, const PGColResult* const b);
 
 char* colResultSetFname(PGColResult* const cr, const char* fname);
 char* colResultSetValue(PGColResult* const cr, const char* value);
 
+void freeRowResult(PGRowResult* rr);
+
 #endif // #ifndef _COLRESULT_H_
\ No newline at end of file
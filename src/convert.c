@@ -11,12 +11,16 @@
 // pick up vasprintf
 #define _GNU_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "convert.h"
 #include "log.h"
 #include "transcoder-utils.h"
 
+// sbcsTables, generated at build time by gentables
+#include "sbcs-tables.h"
+
 // ICU includes
 #include "unicode/ucsdet.h"
 #include "unicode/ucnv.h"
@@ -26,35 +30,314 @@
 
 #define STRING_IS_NULL_TERMINATED -1
 
-// detect the charset encoding of a NUL terminated C string
-UErrorCode
-detect_ICU(const char* buffer, const char* hint, char** encoding, char** lang, int32_t* confidence)
+// detector and converters opened once and kept for the whole run, since
+// opening them costs more than detecting or converting a short string.
+// the transcoder is single threaded, so one cache serves it
+static UCharsetDetector* detector = NULL;
+static bool detectorHinted = false;
+
+static ConverterCacheEntry converterCache[CONVERTER_CACHE_SIZE];
+static int converterCacheUsed = 0;
+static int converterCacheNext = 0;
+
+// output of convert_to_utf8(), reused for every value
+static char* outputBuf = NULL;
+static size_t outputCap = 0;
+
+// the run's charset detector, opened on first use.  a hint, once
+// declared, can't be taken back, so a detector that had one is reopened
+// for a call without
+static UCharsetDetector* getDetector(const char* hint, UErrorCode* status)
 {
-    UCharsetDetector* csd;
-    const UCharsetMatch* csm;
-    UErrorCode status = U_ZERO_ERROR;
+    if (detector != NULL && detectorHinted && hint == NULL)
+    {
+        ucsdet_close(detector);
+        detector = NULL;
+    }
 
-    csd = ucsdet_open(&status);
+    if (detector == NULL)
+    {
+        detector = ucsdet_open(status);
+        detectorHinted = false;
+
+        if (U_FAILURE(*status))
+        {
+            ucsdet_close(detector);
+            detector = NULL;
+            return NULL;
+        }
+    }
 
     // set "hint" encoding if given
     if (hint)
     {
-        ucsdet_setDeclaredEncoding(csd, hint, STRING_IS_NULL_TERMINATED, &status);
+        ucsdet_setDeclaredEncoding(detector, hint, STRING_IS_NULL_TERMINATED, status);
+        detectorHinted = true;
 
-        if (U_FAILURE(status))
+        if (U_FAILURE(*status))
         {
             LOGSTDERR(
                 ERROR,
-                u_errorName(status),
+                u_errorName(*status),
                 "ICU error: %s\nResetting detector.",
-                u_errorName(status));
+                u_errorName(*status));
 
             // make sure the detector is reset
-            ucsdet_close(csd);
-            csd = ucsdet_open(&status);
+            ucsdet_close(detector);
+            *status = U_ZERO_ERROR;
+            detector = ucsdet_open(status);
+            detectorHinted = false;
+        }
+    }
+
+    return detector;
+}
+
+// give up a cache slot whose converter couldn't be set up, moving the
+// last one into it
+static void dropConverter(ConverterCacheEntry* entry)
+{
+    converterCacheUsed--;
+
+    if (entry != &converterCache[converterCacheUsed])
+        *entry = converterCache[converterCacheUsed];
+
+    if (converterCacheNext >= converterCacheUsed)
+        converterCacheNext = 0;
+}
+
+// the cached converter for an encoding, opened, and for force mode given
+// the SKIP and flagging callbacks, on first use: to Unicode for a source
+// encoding, from Unicode for UTF-8.  reset, with its flag cleared, for
+// the caller's string.  returns NULL if it can't be opened
+static ConverterCacheEntry* getConverter(const char* encoding, bool toU, bool force,
+                                         UErrorCode* status)
+{
+    ConverterCacheEntry* entry = NULL;
+    const char* name = NULL;
+    UErrorCode aliasStatus = U_ZERO_ERROR;
+    int i = 0;
+
+    // aliases of an encoding share one converter
+    name = ucnv_getAlias(encoding, 0, &aliasStatus);
+
+    if (U_FAILURE(aliasStatus) || name == NULL)
+        name = encoding;
+
+    for (i = 0; i < converterCacheUsed; i++)
+    {
+        entry = &converterCache[i];
+
+        if (entry->toU == toU && entry->force == force && strcmp(entry->name, name) == 0)
+        {
+            ucnv_reset(entry->conv);
+
+            if (entry->toUContext)
+                entry->toUContext->flag = FALSE;
+
+            if (entry->fromUContext)
+                entry->fromUContext->flag = FALSE;
+
+            return entry;
         }
     }
 
+    // full; close the oldest converter to make room
+    if (converterCacheUsed == CONVERTER_CACHE_SIZE)
+    {
+        entry = &converterCache[converterCacheNext];
+        converterCacheNext = (converterCacheNext + 1) % CONVERTER_CACHE_SIZE;
+
+        // frees the flagging context too
+        ucnv_close(entry->conv);
+        free((void *) entry->name);
+    }
+    else
+    {
+        entry = &converterCache[converterCacheUsed++];
+    }
+
+    memset(entry, 0, sizeof(ConverterCacheEntry));
+
+    entry->conv = ucnv_open(encoding, status);
+
+    if (U_FAILURE(*status))
+    {
+        LOGSTDERR(
+            ERROR,
+            u_errorName(*status),
+            "ICU error - cannot open %s converter.\n",
+            encoding);
+
+        ucnv_close(entry->conv);
+        dropConverter(entry);
+        return NULL;
+    }
+
+    entry->name  = strdup(name);
+    entry->toU   = toU;
+    entry->force = force;
+
+    if (force && toU)
+    {
+        // set callback to skip illegal, irregular or unassigned bytes
+
+        // set converter to use SKIP callback
+        // contecxt will save and call it after calling custom callback
+        ucnv_setToUCallBack(entry->conv,
+                            UCNV_TO_U_CALLBACK_SKIP,
+                            NULL, // context
+                            NULL, // subcallback
+                            NULL, // subcontent
+                            status);
+
+        // initialize flagging callback
+        entry->toUContext = flagCB_toU_openContext();
+
+        /* Set our special callback */
+        if (U_SUCCESS(*status))
+            ucnv_setToUCallBack(entry->conv,
+                                flagCB_toU,
+                                entry->toUContext,
+                                &(entry->toUContext->subCallback),
+                                &(entry->toUContext->subContext),
+                                status
+                               );
+    }
+    else if (force)
+    {
+        ucnv_setFromUCallBack(entry->conv,
+                              UCNV_FROM_U_CALLBACK_SKIP,
+                              NULL,  // context
+                              NULL,  // subcallback
+                              NULL,  // subcontent
+                              status);
+
+        entry->fromUContext = flagCB_fromU_openContext();
+
+        if (U_SUCCESS(*status))
+            ucnv_setFromUCallBack(entry->conv,
+                                  flagCB_fromU,
+                                  entry->fromUContext,
+                                  &(entry->fromUContext->subCallback),
+                                  &(entry->fromUContext->subContext),
+                                  status
+                                 );
+    }
+
+    if (U_FAILURE(*status))
+    {
+        LOGSTDERR(
+            ERROR,
+            u_errorName(*status),
+            "ICU error - cannot set FLAG callback for %s converter.\n",
+            encoding);
+
+        // the flagging context is only freed by the converter once set
+        ucnv_close(entry->conv);
+        free((void *) entry->name);
+        dropConverter(entry);
+        return NULL;
+    }
+
+    return entry;
+}
+
+// make the output buffer hold at least size bytes, keeping what's in it
+static void reserveOutput(size_t size)
+{
+    char* grown = NULL;
+
+    if (size <= outputCap)
+        return;
+
+    grown = realloc(outputBuf, size);
+
+    if (grown == NULL)
+    {
+        perror("realloc - conversion output buffer");
+        exit(EXIT_FAILURE);
+    }
+
+    outputBuf = grown;
+    outputCap = size;
+}
+
+// the generated table for an encoding, if it has one.  the detector's
+// names match a table's own; other aliases match its canonical name
+static const SbcsTable* getSbcsTable(const char* encoding)
+{
+    const char* name = NULL;
+    UErrorCode status = U_ZERO_ERROR;
+    size_t i = 0;
+
+    for (i = 0; i < sizeof(sbcsTables) / sizeof(sbcsTables[0]); i++)
+    {
+        if (strcmp(sbcsTables[i].name, encoding) == 0)
+            return &sbcsTables[i];
+    }
+
+    name = ucnv_getAlias(encoding, 0, &status);
+
+    if (U_FAILURE(status) || name == NULL)
+        return NULL;
+
+    for (i = 0; i < sizeof(sbcsTables) / sizeof(sbcsTables[0]); i++)
+    {
+        if (strcmp(sbcsTables[i].canonical, name) == 0)
+            return &sbcsTables[i];
+    }
+
+    return NULL;
+}
+
+// close the cached detector and converters
+void convert_close_cache(void)
+{
+    int i = 0;
+
+    if (detector)
+        ucsdet_close(detector);
+
+    detector = NULL;
+
+    // closing a converter frees its flagging context
+    for (i = 0; i < converterCacheUsed; i++)
+    {
+        ucnv_close(converterCache[i].conv);
+        free((void *) converterCache[i].name);
+    }
+
+    converterCacheUsed = 0;
+    converterCacheNext = 0;
+
+    free((void *) outputBuf);
+    outputBuf = NULL;
+    outputCap = 0;
+}
+
+// detect the charset encoding of a NUL terminated C string
+UErrorCode
+detect_ICU(const char* buffer, const char* hint, char** encoding, char** lang, int32_t* confidence)
+{
+    UCharsetDetector* csd;
+    const UCharsetMatch* csm;
+    UErrorCode status = U_ZERO_ERROR;
+
+    csd = getDetector(hint, &status);
+
+    if (csd == NULL)
+    {
+        LOGSTDERR(ERROR, u_errorName(status),
+            "ICU error: cannot open charset detector: %s\n", u_errorName(status));
+
+        *encoding = NULL;
+        *lang = NULL;
+        *confidence = 0;
+
+        return status;
+    }
+
     // set conversion string buffer
     // use -1 for string length since NUL terminated
     ucsdet_setText(csd, buffer, STRING_IS_NULL_TERMINATED, &status);
@@ -94,263 +377,154 @@ detect_ICU(const char* buffer, const char* hint, char** encoding, char** lang, i
         *confidence = ucsdet_getConfidence(csm, &status);
     }
 
-    // close charset detector
-    // UCharsetMatch is owned by UCharsetDetector so its memory will be
-    // freed when the char set detector is closed
-    ucsdet_close(csd);
+    // the detector is kept for the next string.  the UCharsetMatch it
+    // owns is only valid until then, but the names it gives are ICU's
+    // own constants
     return status;
 }
 
-// Convert from detected encoding to ICU internal Unicode
+// Convert from the detected encoding straight to UTF8, in one pass with
+// ucnv_convertEx() through a small pivot on the stack, into a buffer
+// kept for the whole run and grown as needed.  *converted_buf points into
+// that buffer, NUL terminated, until the next call
 
 UErrorCode
-convert_to_unicode( const char* buffer, const char* encoding,
-                    UChar** uBuf, int32_t *uBuf_len,
-                    bool force, bool* dropped_bytes,
-                    const int debug)
+convert_to_utf8(const char* buffer, int32_t buffer_len, const char* encoding,
+                const char** converted_buf, int32_t* converted_buf_len,
+                bool force, bool* dropped_bytes,
+                const int debug)
 {
     UErrorCode status = U_ZERO_ERROR;
 
-    UConverter *conv;
-    int32_t uConvertedLen = 0;
-
-    // used to set dropped_bytes flag if force is true
-    ToUFLAGContext* context = NULL;
+    ConverterCacheEntry* source = NULL;
+    ConverterCacheEntry* utf8 = NULL;
 
-    size_t uBufSize = 0;
+    UChar pivot[CONVERT_PIVOT_SIZE];
+    UChar* pivotSource = pivot;
+    UChar* pivotTarget = pivot;
 
-    // open converter for detected encoding
-    conv = ucnv_open(encoding, &status);
+    const char* input = buffer;
+    char* target = NULL;
+    size_t used = 0;
+    bool reset = true;
 
-    if (U_FAILURE(status))
-    {
-        LOGSTDERR(
-            ERROR,
-            u_errorName(status),
-            "ICU error - cannot open %s converter.\n",
-            encoding);
+    // cached converters for detected encoding and UTF8
+    source = getConverter(encoding, true, force, &status);
 
-        ucnv_close(conv);
+    if (source == NULL)
         return status;
-    }
 
-    if (force)
-    {
-        // set callback to skip illegal, irregular or unassigned bytes
+    utf8 = getConverter("utf-8", false, force, &status);
 
-        // set converter to use SKIP callback
-        // contecxt will save and call it after calling custom callback
-        ucnv_setToUCallBack(conv,
-                            UCNV_TO_U_CALLBACK_SKIP,
-                            NULL, // context
-                            NULL, // subcallback
-                            NULL, // subcontent
-                            &status);
-
-        if (U_FAILURE(status))
-        {
-            LOGSTDERR(
-                ERROR,
-                u_errorName(status),
-                "ICU error - cannot set SKIP callback for %s converter.\n",
-                encoding);
-
-            ucnv_close(conv);
-            return status;
-        }
-
-        // initialize flagging callback
-        context = flagCB_toU_openContext();
-
-        /* Set our special callback */
-        ucnv_setToUCallBack(conv,
-                            flagCB_toU,
-                            context,
-                            &(context->subCallback),
-                            &(context->subContext),
-                            &status
-                           );
-
-        if (U_FAILURE(status))
-        {
-            LOGSTDERR(
-                ERROR,
-                u_errorName(status),
-                "ICU error - cannot set FLAG callback for %s converter.\n",
-                encoding);
+    if (utf8 == NULL)
+        return status;
 
-            ucnv_close(conv);
-            return status;
-        }
-    }
+    if (debug)
+        LOGSTDERR(DEBUG, u_errorName(status), "Original string: %s\n", buffer);
 
-    // allocate unicode buffer
-    // must free before exiting calling function
-    uBufSize = (strlen(buffer)/ucnv_getMinCharSize(conv) + 1);
-    *uBuf = (UChar*) calloc(sizeof(UChar), uBufSize * sizeof(UChar));
+    // most single byte text needs a little more room as UTF8; grow as
+    // needed, keeping a byte for the NUL terminator
+    reserveOutput((size_t) buffer_len + buffer_len / 2 + 16);
 
-    if (*uBuf == NULL)
+    do
     {
-        status = U_MEMORY_ALLOCATION_ERROR;
+        status = U_ZERO_ERROR;
+        target = outputBuf + used;
 
-        LOGSTDERR(
-            ERROR,
-            u_errorName(status),
-            "ICU error - cannot allocate %d bytes for Unicode pivot buffer.\n",
-            (int) uBufSize);
+        // picks up where it left off when the output filled up
+        ucnv_convertEx(utf8->conv, source->conv,
+                       &target, outputBuf + outputCap - 1,
+                       &input, buffer + buffer_len,
+                       pivot, &pivotSource, &pivotTarget, pivot + CONVERT_PIVOT_SIZE,
+                       reset, true, &status);
 
-        ucnv_close(conv);
-        return status;
-    }
+        used = target - outputBuf;
+        reset = false;
 
-    if (debug)
-        LOGSTDERR(DEBUG, u_errorName(status), "Original string: %s\n", buffer);
-
-    // convert to Unicode
-    // returns length of converted string, not counting NUL-terminator
-    uConvertedLen = ucnv_toUChars(conv,
-                                  *uBuf,
-                                  uBufSize,
-                                  buffer,
-                                  STRING_IS_NULL_TERMINATED,
-                                  &status
-                                 );
+        if (status == U_BUFFER_OVERFLOW_ERROR)
+            reserveOutput(outputCap * 2);
+    }
+    while (status == U_BUFFER_OVERFLOW_ERROR);
 
     if (U_SUCCESS(status))
     {
-        // add 1 for NUL terminator
-        *uBuf_len = uConvertedLen + 1;
+        outputBuf[used] = '\0';
+
+        *converted_buf = outputBuf;
+        *converted_buf_len = (int32_t) used;
+
+        if (debug)
+            LOGSTDERR(INFO, u_errorName(status),
+                "Converted string %s\n", outputBuf);
 
-        // see if any bytes where dropped
-        // context struct will go away with converter is closed
+        // see if any bytes where dropped, going to or from Unicode
         if (force)
-            *dropped_bytes = context->flag;
+            *dropped_bytes = (source->toUContext->flag || utf8->fromUContext->flag);
         else
             *dropped_bytes = false;
     }
-
-    if (U_FAILURE(status))
+    else
     {
         LOGSTDERR(ERROR, u_errorName(status),
-            "ICU conversion to Unicode failed for: %s\n", encoding);
+            "ICU conversion from %s to UTF8 failed.\n", encoding);
     }
 
-    ucnv_close(conv);
     return status;
 }
 
-// Convert from ICU internal Unicode to UTF8
+// Convert a single byte encoding with a generated table to UTF8, a table
+// lookup per byte, into convert_to_utf8()'s buffer.  unmapped bytes are
+// skipped and flagged when forcing, and substituted as ICU would
+// otherwise.  returns false, without converting, if the encoding has no
+// table
 
-UErrorCode
-convert_to_utf8(const UChar* buffer, int32_t buffer_len,
-                char** converted_buf, int32_t *converted_buf_len,
-                bool force, bool* dropped_bytes,
-                const int debug)
+bool
+convert_sbcs_to_utf8(const char* buffer, int32_t buffer_len, const char* encoding,
+                     const char** converted_buf, int32_t* converted_buf_len,
+                     bool force, bool* dropped_bytes)
 {
-    UConverter *conv;
-    UErrorCode status = U_ZERO_ERROR;
-    int32_t utfConvertedLen = 0;
+    const SbcsTable* table = NULL;
+    const SbcsChar* ch = NULL;
+    const unsigned char* input = (const unsigned char*) buffer;
+    const unsigned char* end = input + buffer_len;
+    char* target = NULL;
+    bool unmapped = false;
 
-    // used to set dropped_bytes flag if force is true
-    FromUFLAGContext* context = NULL;
+    table = getSbcsTable(encoding);
 
-    // open UTF8 converter
-    conv = ucnv_open("utf-8", &status);
+    if (table == NULL)
+        return false;
 
-    if (U_FAILURE(status))
-    {
-        LOGSTDERR(ERROR, u_errorName(status),
-            "ICU error - Cannot open utf-8 converter.\n", NULL);
+    // every byte fits, copied whole, with the NUL terminator
+    reserveOutput((size_t) buffer_len * SBCS_MAX_UTF8 + 1);
 
-        ucnv_close(conv);
-        return status;
-    }
+    target = outputBuf;
 
-    if (force)
+    for (; input < end; input++)
     {
-        // set callback to skip illegal, irregular or unassigned bytes
+        ch = &table->chars[*input];
 
-        // set converter to use SKIP callback
-        // contecxt will save and call it after calling custom callback
-        ucnv_setFromUCallBack(conv,
-                              UCNV_FROM_U_CALLBACK_SKIP,
-                              NULL,  // context
-                              NULL,  // subcallback
-                              NULL,  // subcontent
-                              &status);
-
-        if (U_FAILURE(status))
+        if (ch->length == 0)
         {
-            LOGSTDERR(
-                ERROR,
-                u_errorName(status),
-                "ICU error - cannot set SKIP callback for UTF8 converter.\n",
-                NULL);
-
-            ucnv_close(conv);
-            return status;
-        }
+            unmapped = true;
 
-        // initialize flagging callback
-        context = flagCB_fromU_openContext();
+            if (force)
+                continue;
 
-        /* Set our special callback */
-        ucnv_setFromUCallBack(conv,
-                              flagCB_fromU,
-                              context,
-                              &(context->subCallback),
-                              &(context->subContext),
-                              &status
-                             );
-
-        if (U_FAILURE(status))
-        {
-            LOGSTDERR(ERROR, u_errorName(status),
-                "ICU error - cannot set FLAG callback for UTF8 converter.\n",
-                NULL);
-
-            ucnv_close(conv);
-            return status;
+            ch = &table->substitute;
         }
-    }
-
-    // convert to UTF8
-    // input buffer from ucnv_toUChars, which always returns a
-    // NUL-terminated buffer
-    utfConvertedLen = ucnv_fromUChars(conv,
-                                      *converted_buf,
-                                      *converted_buf_len,
-                                      buffer,
-                                      STRING_IS_NULL_TERMINATED,
-                                      &status
-                                     );
 
-    if (U_SUCCESS(status))
-    {
-        *converted_buf_len = utfConvertedLen;
+        memcpy(target, ch->utf8, SBCS_MAX_UTF8);
+        target += ch->length;
+    }
 
-        if (debug)
-            LOGSTDERR(INFO, u_errorName(status),
-                "Converted string %s\n", (const char*) *converted_buf);
+    *target = '\0';
 
-        // see if any bytes where dropped
-        // context struct will go away when converter is closed
-        if (force && NULL != context)
-            *dropped_bytes = context->flag;
-        else
-            *dropped_bytes = false;
-    }
+    *converted_buf = outputBuf;
+    *converted_buf_len = (int32_t) (target - outputBuf);
 
-    if (U_FAILURE(status))
-    {
-        LOGSTDERR(
-            ERROR,
-            u_errorName(status),
-            "ICU error - conversion from Unicode to UTF8 failed.\n",
-            NULL);
-    }
+    // as with the flagging callbacks, only forcing drops bytes
+    *dropped_bytes = force && unmapped;
 
-    // close the converter
-    ucnv_close(conv);
-    return status;
+    return true;
 }
@@ -20,17 +20,54 @@
 #include "unicode/ustring.h"
 #include "unicode/uloc.h"
 
+// converters kept open across strings, see getConverter() in convert.c
+#define CONVERTER_CACHE_SIZE 32
+
+// UTF16 code units in the pivot between a source converter and UTF8
+#define CONVERT_PIVOT_SIZE 1024
+
+// most bytes of UTF8 a byte of a single byte encoding maps to, since
+// they only map into the BMP
+#define SBCS_MAX_UTF8 3
+
+typedef struct
+{
+    char*               name;           // canonical converter name
+    UConverter*         conv;           // open converter
+    bool                toU;            // converts to Unicode, from name; otherwise from Unicode, to name
+    bool                force;          // skips and flags bad bytes, see --force
+    ToUFLAGContext*     toUContext;     // flagging callback context when force and toU; freed with conv
+    FromUFLAGContext*   fromUContext;   // flagging callback context when force and not toU; freed with conv
+} ConverterCacheEntry;
+
+// a single byte encoding's byte to UTF8 table, generated from ICU's
+// mappings by gentables at build time, see sbcs-tables.h
+typedef struct
+{
+    unsigned char       utf8[SBCS_MAX_UTF8];    // UTF8 for the byte, padded with NULs
+    unsigned char       length;                 // bytes of utf8 used; 0 if ICU doesn't map the byte
+} SbcsChar;
+
+typedef struct
+{
+    const char*         name;           // encoding, as the charset detector names it
+    const char*         canonical;      // canonical converter name, as getConverter() caches it
+    SbcsChar            chars[256];     // indexed by byte
+    SbcsChar            substitute;     // what ICU writes for an unmapped byte, when not forcing
+} SbcsTable;
+
+void convert_close_cache(void);
+
 UErrorCode detect_ICU(const char* buffer, const char* hint,
                       char** encoding, char** lang, int32_t* confidence);
 
-UErrorCode convert_to_unicode(const char* buffer, const char* encoding,
-                              UChar** uBuf, int32_t* uBuf_len,
-                              bool force, bool* dropped_bytes,
-                              const int debug);
+UErrorCode convert_to_utf8(const char* buffer, int32_t buffer_len, const char* encoding,
+                           const char** converted_buf, int32_t* converted_buf_len,
+                           bool force, bool* dropped_bytes,
+                           const int debug);
 
-UErrorCode convert_to_utf8(const UChar* buffer, int32_t buffer_len,
-                            char** converted_buf, int32_t* converted_buf_len,
-                            bool force, bool* dropped_bytes,
-                            const int debug);
+bool convert_sbcs_to_utf8(const char* buffer, int32_t buffer_len, const char* encoding,
+                          const char** converted_buf, int32_t* converted_buf_len,
+                          bool force, bool* dropped_bytes);
 
 #endif // #ifndef _CONVERT_H_
@@ -0,0 +1,179 @@
+/*
+ * gentables.c
+ *
+ * Build-time generator of byte to UTF8 tables for the single byte
+ * encodings the transcoder sees most, from ICU's own mappings.  Writes
+ * sbcs-tables.h, included by convert.c, to stdout
+ *
+ * Copyright © 2015, AWeber Communications.
+ * All rights reserved.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "unicode/utypes.h"
+#include "unicode/ucnv.h"
+#include "unicode/ucnv_err.h"
+#include "unicode/ustring.h"
+
+#include "convert.h"
+
+// encodings given a table, by the names the ICU charset detector uses
+static const char* encodings[] = {
+    "windows-1252",
+    "ISO-8859-1",
+    "ISO-8859-2",
+    "ISO-8859-15",
+    "KOI8-R",
+    NULL
+};
+
+// UTF8 for one byte of an encoding, or -1 if the converter stops at it
+// as unmapped
+static int byteToUtf8(UConverter* conv, unsigned char byte, char* utf8, int32_t utf8Size)
+{
+    UErrorCode status = U_ZERO_ERROR;
+    UChar uchars[4];
+    int32_t ucharsLen = 0;
+    int32_t utf8Len = 0;
+    char source = (char) byte;
+
+    ucnv_reset(conv);
+
+    ucharsLen = ucnv_toUChars(conv, uchars, 4, &source, 1, &status);
+
+    if (U_FAILURE(status) || ucharsLen == 0)
+        return -1;
+
+    u_strToUTF8(utf8, utf8Size, &utf8Len, uchars, ucharsLen, &status);
+
+    if (U_FAILURE(status))
+        return -1;
+
+    return utf8Len;
+}
+
+static void writeChar(const char* utf8, int length, const char* comment)
+{
+    int i = 0;
+
+    printf("{{");
+
+    for (i = 0; i < SBCS_MAX_UTF8; i++)
+        printf("%s0x%02X", i ? ", " : "", i < length ? (unsigned char) utf8[i] : 0);
+
+    printf("}, %d},%s\n", length, comment);
+}
+
+static void writeTable(const char* encoding, const char* canonical,
+                       UConverter* conv, UConverter* substituting)
+{
+    char utf8[8];
+    char comment[32];
+    char substitute[8];
+    int substituteLength = -1;
+    int length = 0;
+    int byte = 0;
+
+    printf("    {\n");
+    printf("        \"%s\", \"%s\",\n", encoding, canonical);
+    printf("        {\n");
+
+    for (byte = 0; byte < 256; byte++)
+    {
+        length = byteToUtf8(conv, (unsigned char) byte, utf8, sizeof(utf8));
+
+        // single byte encodings only map into the BMP, which takes at
+        // most three bytes of UTF8
+        if (length > SBCS_MAX_UTF8)
+        {
+            fprintf(stderr, "%s byte 0x%02X maps to %d bytes of UTF8\n",
+                encoding, byte, length);
+            exit(EXIT_FAILURE);
+        }
+
+        // what ICU writes in place of an unmapped byte when not forcing
+        if (length < 0 && substituteLength < 0)
+            substituteLength = byteToUtf8(substituting, (unsigned char) byte,
+                substitute, sizeof(substitute));
+
+        if (length < 0)
+            length = 0;
+
+        snprintf(comment, sizeof(comment), " /* 0x%02X%s */", byte, length ? "" : ", unmapped");
+
+        printf("            ");
+        writeChar(utf8, length, comment);
+    }
+
+    printf("        },\n");
+
+    // unused if every byte is mapped
+    if (substituteLength < 0 || substituteLength > SBCS_MAX_UTF8)
+    {
+        substituteLength = 3;
+        memcpy(substitute, "\xEF\xBF\xBD", 3);
+    }
+
+    printf("        ");
+    writeChar(substitute, substituteLength, " /* substitute */");
+
+    printf("    },\n");
+}
+
+int main(int argc, char** argv)
+{
+    UErrorCode status = U_ZERO_ERROR;
+    UConverter* conv = NULL;
+    UConverter* substituting = NULL;
+    const char* canonical = NULL;
+    int i = 0;
+
+    printf("/*\n");
+    printf(" * sbcs-tables.h\n");
+    printf(" *\n");
+    printf(" * Generated by gentables from ICU %s.  Do not edit\n", U_ICU_VERSION);
+    printf(" */\n\n");
+
+    printf("static const SbcsTable sbcsTables[] = {\n");
+
+    for (i = 0; encodings[i] != NULL; i++)
+    {
+        status = U_ZERO_ERROR;
+        conv = ucnv_open(encodings[i], &status);
+        substituting = ucnv_open(encodings[i], &status);
+
+        if (U_FAILURE(status))
+        {
+            fprintf(stderr, "cannot open %s converter: %s\n",
+                encodings[i], u_errorName(status));
+            exit(EXIT_FAILURE);
+        }
+
+        // stop at unmapped bytes instead of substituting them, so
+        // they're left out of the table
+        ucnv_setToUCallBack(conv, UCNV_TO_U_CALLBACK_STOP, NULL, NULL, NULL, &status);
+
+        // the name getConverter() caches the converter by, so aliases of
+        // an encoding find its table too
+        canonical = ucnv_getAlias(encodings[i], 0, &status);
+
+        if (U_FAILURE(status) || canonical == NULL)
+        {
+            fprintf(stderr, "cannot set up %s converter: %s\n",
+                encodings[i], u_errorName(status));
+            exit(EXIT_FAILURE);
+        }
+
+        writeTable(encodings[i], canonical, conv, substituting);
+
+        ucnv_close(conv);
+        ucnv_close(substituting);
+    }
+
+    printf("};\n");
+
+    return EXIT_SUCCESS;
+}
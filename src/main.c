@@ -29,6 +29,9 @@ NO OBLIGATIONS TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR
 MODIFICATIONS.
 */
 
+// pick up asprintf
+#define _GNU_SOURCE
+
 // PostgreSQL and C includes
 #include "libpq-fe.h"
 
@@ -39,12 +42,16 @@ MODIFICATIONS.
 #include "log.h"
 #include "vector.h"
 #include "colresult.h"
+#include "reader.h"
+#include "writer.h"
+#include "rebuild.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <locale.h>
 #include <sys/time.h>
+#include <unistd.h>
 
 /*
  * program structure:
@@ -68,10 +75,203 @@ MODIFICATIONS.
 PGconn* readCxn;
 PGconn* writeCxn;
 
-int main (int argc, char** argv)
+// detect, convert and log the character-based column values of one row,
+// and hand the row to the writer if any of them changed
+static void convertRow(const char* uniqueKeyCols,
+                       const char* uniqueKeyValues,
+                       const Vector* ukTuple,
+                       const char* ctid,
+                       const char* xmin,
+                       const char* rereadKey,
+                       Vector* cbColValues,
+                       RowWriter* writer)
+{
+    // converted character-based column values that differ from the
+    // originals; only these are written
+    Vector newCBColValues;
+
+    // boolean flags
+    bool written = false;
+
+    // for loop indexes
+    int i = 0;
+    int changed = 0;
+
+    LOGSTDERR(INFO, PQresStatus(PGRES_COMMAND_OK),
+            "Converting %s: %s", uniqueKeyCols, uniqueKeyValues);
+
+    // with --skip-ascii-columns a pure ASCII row has no values to convert
+    if (cbColValues->size == 0)
+    {
+        LOGSTDERR(INFO, "NO_CONVERSION",
+            "No columns require conversion - skipping update of %s=%s.",
+             uniqueKeyCols, uniqueKeyValues);
+
+        return;
+    }
+
+    // initialize converted values vector to appropriate size
+    vector_init(&newCBColValues, "PGColResult*", cbColValues->size);
+
+    // detect charset, transcode and log each value
+    convertCBColValues(uniqueKeyCols, uniqueKeyValues, cbColValues, &newCBColValues);
+
+    // only write the columns whose bytes changed, so unchanged values,
+    // e.g. large TOASTed ones, aren't rewritten
+    for (i = 0; i < newCBColValues.size; i++)
+    {
+        if (colResultValueEquals(cbColValues->data[i], newCBColValues.data[i]))
+            freeColResult(newCBColValues.data[i]);
+        else
+            newCBColValues.data[changed++] = newCBColValues.data[i];
+    }
+
+    newCBColValues.size = changed;
+
+    // if passed --report option do not save to db
+    if(!field.report)
+    {
+        if (newCBColValues.size > 0)
+        {
+            // write the changed values back to same row, now or with the
+            // next --write-batch-size rows.  the writer takes over the
+            // converted values
+            rowWriterWrite(writer, uniqueKeyValues, ukTuple, ctid, xmin, rereadKey,
+                           &newCBColValues);
+            written = true;
+        }
+        else
+        {
+            LOGSTDERR(INFO, "NO_CONVERSION",
+                "No columns require conversion - skipping update of %s=%s.",
+                 uniqueKeyCols, uniqueKeyValues);
+        }
+    }
+
+    // free the converted data buffers
+    if (!written)
+        vector_free(&newCBColValues);
+}
+
+// re-read, convert and write again the rows the writer found changed
+// since they were read under --optimistic, or deferred because they were
+// locked, until none are left or --conflict-retries runs out, waiting
+// --retry-backoff milliseconds, doubled each time, between rounds so
+// the transactions holding them can finish.  rows still changing or
+// locked are left with the writer, which fails them.  under --scan=ctid
+// rows are re-read by rereadKeyCols, the table's unique key, if it has
+// one, and written by the ctid and xmin they're found at
+static void retryConflicts(const char* uniqueKeyCols,
+                           const char* rereadKeyCols,
+                           const PGresult* cbColFields,
+                           RowWriter* writer)
 {
-    PGresult *writeResult = NULL;
+    Vector conflicts;
+    Vector cbColValues;
+    Vector ctidTuple;
+    char *ctidKeyValues = NULL;
+    char *rowCtid = NULL;
+    char *rowXmin = NULL;
+    unsigned long retry = 0;
+    unsigned long backoff = field.retryBackoff;
+    int i = 0;
+
+    for (retry = 1; retry <= field.conflictRetries; retry++)
+    {
+        if (rowWriterTakeConflicts(writer, &conflicts) == 0)
+        {
+            vector_free(&conflicts);
+            return;
+        }
+
+        // the first round comes after the table was walked; give the
+        // rounds after it more and more time
+        if (retry > 1 && backoff > 0)
+        {
+            usleep(backoff * 1000);
+            backoff *= 2;
+        }
 
+        LOGSTDERR(INFO, PQresStatus(PGRES_COMMAND_OK),
+            "Re-reading %d rows changed since they were read or locked, retry %lu of %lu",
+            conflicts.size, retry, field.conflictRetries);
+
+        for (i = 0; i < conflicts.size; i++)
+        {
+            PGRowResult* conflict = vector_get(&conflicts, i);
+
+            // the writer queues rows by their unique key values alone
+            if (rereadKeyCols && conflict->ukTuple.size == 0)
+                getUniqueKeyTuple(&conflict->ukTuple, conflict->ukValues);
+
+            vector_init(&cbColValues, "PGColResult*", 0);
+
+            getCBColValues(&cbColValues, &rowCtid, &rowXmin, &conflict->ukTuple,
+                           conflict->ukValues, cbColFields);
+
+            if (rowCtid == NULL && field.skipLocked &&
+                rowExists(&conflict->ukTuple, conflict->ukValues))
+            {
+                rowWriterDefer(writer, conflict->ukValues, &conflict->ukTuple);
+            }
+            else if (rowCtid == NULL)
+            {
+                LOGSTDOUT(WARNING, PQresStatus(PGRES_TUPLES_OK),
+                    "%s.%s, %s=%s was deleted since it was read; not updated.\n",
+                    field.schema, field.table,
+                    (rereadKeyCols ? rereadKeyCols : uniqueKeyCols), conflict->ukValues);
+            }
+            else if (rereadKeyCols)
+            {
+                // write the row version just read, by its ctid and xmin
+                if (asprintf(&ctidKeyValues, "'%s'::tid, '%s'::bigint", rowCtid, rowXmin) < 0)
+                {
+                    perror("asprintf - ctid key values");
+                    clean_exit(EXIT_FAILURE);
+                }
+
+                vector_init(&ctidTuple, "char*", 2);
+                vector_append(&ctidTuple, (void *) strdup(rowCtid));
+                vector_append(&ctidTuple, (void *) strdup(rowXmin));
+
+                convertRow(uniqueKeyCols,
+                           ctidKeyValues,
+                           &ctidTuple,
+                           rowCtid,
+                           rowXmin,
+                           conflict->ukValues,
+                           &cbColValues,
+                           writer);
+
+                vector_free(&ctidTuple);
+                free((void *) ctidKeyValues);
+                ctidKeyValues = NULL;
+            }
+            else
+            {
+                convertRow(uniqueKeyCols,
+                           conflict->ukValues,
+                           &conflict->ukTuple,
+                           rowCtid,
+                           rowXmin,
+                           NULL,
+                           &cbColValues,
+                           writer);
+            }
+
+            vector_free(&cbColValues);
+            free((void *) rowCtid);
+            free((void *) rowXmin);
+            rowCtid = NULL;
+            rowXmin = NULL;
+        }
+
+        vector_free(&conflicts);
+    }
+}
+
+int main (int argc, char** argv)
+{
     // exit code for transcoder
     int exitCode = EXIT_SUCCESS;
 
@@ -81,26 +281,53 @@ int main (int argc, char** argv)
     char *uniqueKeyColsCast = NULL;
     char *uniqueKeyCols = NULL;
     char *uniqueKeyDataTypes = NULL;
+    char *ukValuesExpr = NULL;
+
+    // under --scan=ctid, the table's unique key, if it has one, that rows
+    // the writer finds changed are re-read by; NULL otherwise
+    char *rereadKeyColsCast = NULL;
+    char *rereadKeyCols = NULL;
+    char *rereadKeyDataTypes = NULL;
+    char *rereadKeyExpr = NULL;
+    char *ukParamList = NULL;
     char *uniqueKeyValues = NULL;
     char *nextKeyValues = NULL;
     char *prevUniqueKeyValues = NULL;
 
+    // --non-ascii-only predicate, NULL to read every row
+    char *nonAsciiFilter = NULL;
+    bool limitReached = false;
+
     // character-based column names and values
     Vector cbColNames;
     Vector cbColValues;
-    Vector newCBColValues;
 
-    // pointer to string to convert
-    const char* buffer = NULL;
-    const char* converted_buffer = NULL;
+    // plain character-based column descriptions for --skip-ascii-columns
+    PGresult* cbColFields = NULL;
+
+    // current unique key values as a typed tuple, one text value per column
+    Vector ukTuple;
+
+    // heap tuple the current row was read from, and the transaction
+    // that wrote it
+    char *rowCtid = NULL;
+    char *rowXmin = NULL;
+    Vector ukColNames;
+    int ukColCount = 0;
+
+    // batch of rows read in one round trip
+    Vector rows;
+    RowReader reader;
 
-    // encoding, language & confidence level
-    char *encoding = NULL;
-    char *lang = NULL;
-    int32_t confidence = 0;
+    // converted rows waiting to be written
+    RowWriter writer;
 
-    // conversion timestamp
-    char conversion_ts[28] = {0};
+    // shadow table for --mode=rebuild
+    Rebuild rebuild;
+
+    // rows the writer finds changed or locked are re-read one at a time
+    // after the table has been walked
+    bool rereadRows = false;
 
     // runtime stats
     struct timeval start_tv, end_tv, diff_tv;
@@ -108,12 +335,9 @@ int main (int argc, char** argv)
 
     // rows processed
     unsigned long totalRows = 0;
+    unsigned long rowsVisited = 0;
     unsigned long rowsUpdated = 0;
 
-    // boolean flags
-    bool converted = false;
-    bool dropped_bytes = false;
-
     // read and write char-based columns queries
     const char *readQuery  = NULL;
     const char *writeQuery = NULL;
@@ -124,10 +348,6 @@ int main (int argc, char** argv)
     // for loop index
     int i = 0;
 
-    // pre and post conversion sql
-    char* sqlPre = NULL;
-    char* sqlPost  = NULL;
-
     // set start time
     gettimeofday(&start_tv, NULL);
 
@@ -142,197 +362,276 @@ int main (int argc, char** argv)
     readCxn  = openDbConnection(field.dsn);
     writeCxn = openDbConnection(field.dsn);
 
-    getShortestUniqueIndex(field.schema, field.table,
-                            &uniqueKeyColsCast,
-                            &uniqueKeyCols,
-                            &uniqueKeyDataTypes);
-
-    // get character-based columns for table
-    getCBColNames(&cbColNames, field.schema, field.table);
-
-    // construct read query
-    readQuery = constructReadQuery(&cbColNames);
-
-    if (field.oneRowKey)
-    {
-        uniqueKeyValues = field.oneRowKey;
-    }
-    else if (field.restartKey)
+    if (field.scan == SCAN_CTID)
     {
-        uniqueKeyValues = field.restartKey;
+        // rows are identified by ctid and xmin, so no unique index is needed
+        uniqueKeyCols      = strdup(CTID_KEY_COLS);
+        uniqueKeyDataTypes = strdup(CTID_KEY_DATA_TYPES);
+
+        // a row updated after it was read has a new ctid and xmin, so
+        // it's re-read by the table's unique key, if it has one
+        getShortestUniqueIndex(field.schema, field.table,
+                                &rereadKeyColsCast,
+                                &rereadKeyCols,
+                                &rereadKeyDataTypes);
+
+        if (rereadKeyCols[0] != '\0')
+        {
+            rereadKeyExpr = constructUkValuesExpr(rereadKeyCols, rereadKeyDataTypes);
+        }
+        else
+        {
+            free((void *) rereadKeyCols);
+            rereadKeyCols = NULL;
+        }
     }
     else
     {
-        // get lowest unique key value
-        uniqueKeyValues = getInitUniqueKeyValues(field.schema, field.table,
-                            uniqueKeyCols);
+        getShortestUniqueIndex(field.schema, field.table,
+                                &uniqueKeyColsCast,
+                                &uniqueKeyCols,
+                                &uniqueKeyDataTypes);
     }
 
+    rereadRows = (field.optimistic || field.lockTimeout > 0 ||
+                  field.statementTimeout > 0 || field.skipLocked ||
+                  rereadKeyCols != NULL);
+
+    // get character-based columns for table
+    getCBColNames(&cbColNames, field.schema, field.table);
+
+    // leave pure ASCII rows on the server; --one-row is read regardless
+    if (field.nonAsciiOnly && !field.oneRowKey)
+        nonAsciiFilter = constructNonAsciiFilter(&cbColNames);
+
     LOGSTDERR(INFO, PQresStatus(PGRES_COMMAND_OK),
               "Starting conversion of %s\n", fullTableName);
 
     // print conversion log csv header
     printConversionLogHeader();
 
-    // convert until no more rows
-    while (uniqueKeyValues != NULL)
+    // a rebuild writes with COPY on writeCxn itself, which the writer's
+    // session settings would otherwise apply to
+    if (field.mode != MODE_REBUILD)
+        rowWriterOpen(&writer, field.write, writeCxn, fullTableName,
+                      uniqueKeyCols, uniqueKeyDataTypes, rereadKeyCols, &cbColNames,
+                      field.writeBatchSize, field.commitEvery,
+                      field.commitInterval, field.asyncCommit,
+                      field.pipelineDepth, field.optimistic,
+                      field.lockTimeout, field.statementTimeout);
+
+    // rows are read one at a time without --batch-size, and the rows
+    // changed since they were read under --optimistic, or deferred
+    // because they were locked, are re-read one at a time after the table
+    // has been walked.  a rebuild reads the whole table with COPY
+    if (field.mode != MODE_REBUILD &&
+        (field.batchSize == 0 || field.oneRowKey || rereadRows))
     {
-        totalRows++;
+        // construct read query
+        readQuery = constructReadQuery(&cbColNames);
 
-        if (field.limit > 0 && field.limit < totalRows)
-        {
-            totalRows--;
-            break;
-        }
+        // "$1::<type>, ..." to bind the key tuple to.  under --scan=ctid
+        // rows are re-read by the table's unique key, if it has one
+        ukParamList = constructUkParamList(rereadKeyCols ? rereadKeyDataTypes : uniqueKeyDataTypes);
 
-        LOGSTDERR(INFO, PQresStatus(PGRES_COMMAND_OK),
-                "Converting %s: %s", uniqueKeyCols, uniqueKeyValues);
+        if (field.skipAsciiColumns)
+            cbColFields = describeCBCols(&cbColNames, fullTableName);
+
+        // parse and plan the read query once
+        ukColCount = splitString(&ukColNames, (rereadKeyCols ? rereadKeyCols : uniqueKeyCols), ", ");
+        vector_free(&ukColNames);
 
-        // initialize  values vectors to appropriate size
-        vector_init(&cbColValues, "PGColResult*", cbColNames.size);
-        vector_init(&newCBColValues, "PGColResult*", cbColNames.size);
+        prepareReadQuery(readQuery, fullTableName,
+                         (rereadKeyCols ? rereadKeyCols : uniqueKeyCols), ukParamList, ukColCount);
+    }
+
+    if (field.mode == MODE_REBUILD)
+    {
+        // stream every row, converted, into a shadow table, then build
+        // its indexes, catch up on the changes made meanwhile and swap it in
+        rebuildOpen(&rebuild, readCxn, writeCxn, field.schema, field.table,
+                    fullTableName, uniqueKeyCols, uniqueKeyDataTypes, &cbColNames);
 
-        // get row to convert
-        getCBColValues(&cbColValues, readQuery,
-                      fullTableName, uniqueKeyCols, uniqueKeyValues);
+        rebuildCopy(&rebuild);
+        rebuildFinish(&rebuild);
 
-        // detect charset and transcode it
-        for(i = 0; i < cbColValues.size; i++)
+        totalRows   = rebuild.rowsCopied;
+        rowsUpdated = rebuild.rowsChanged;
+
+        rebuildClose(&rebuild);
+    }
+    else if (field.batchSize > 0 && !field.oneRowKey)
+    {
+        // read --batch-size rows per round trip, ordered by the shortest
+        // unique key, either carrying the last key forward as the cursor
+        // or fetching from a server-side cursor, or read the heap
+        // --batch-size blocks at a time
+        rowReaderOpen(&reader, field.scan, readCxn, fullTableName,
+                      uniqueKeyCols, uniqueKeyDataTypes,
+                      &cbColNames, rereadKeyExpr, nonAsciiFilter, field.restartKey,
+                      field.batchSize, field.limit);
+
+        vector_init(&rows, "PGRowResult*", field.batchSize);
+
+        while (rowReaderNext(&reader, &rows) > 0)
         {
-            // pointers for column result structs
-            PGColResult* colResult = NULL;
-            PGColResult* newColResult = NULL;
-
-            // get the current value for the first column
-            colResult = vector_get(&cbColValues, i);
-
-            // copy it to the new column result struct and update value and length after conversion
-            // copyColResult allocates memory for newColResult;
-            newColResult = copyColResult(colResult, newColResult);
-
-            // transcode and get converted value
-            converted_buffer = transcode(colResult, field.hint,
-                                &encoding, &lang, &confidence,
-                                conversion_ts, sizeof(conversion_ts),
-                                &converted, &dropped_bytes);
-
-            // save converted value and length in vector
-            colResultSetValue(newColResult, converted_buffer);
-
-            // newColResult gets freed when newCbColValues gets freed
-            vector_set(&newCBColValues, i, (void *) newColResult);
-
-            // clear and populate vector value
-            // for each column
-            ConversionLog* cl = newConversionLog();
-
-            cl = populateConversionLog(
-                    cl,
-                    colResult,
-                    newColResult,
-                    uniqueKeyCols,
-                    uniqueKeyValues,
-                    encoding,
-                    lang,
-                    confidence,
-                    conversion_ts,
-                    converted,
-                    dropped_bytes);
-
-            // developer log it!
-            printConversionLog(cl);
-
-            // don't need the conversion log anymore
-            freeConversionLog(cl);
-            free((void *) cl);
-
-            // encoding, lang and escaped string are
-            // freed by freeConversionLog
-            // reset indicators
-            confidence = 0;
-            converted = false;
-            dropped_bytes = false;
-
-            // this isn't a memory leak, since they're freed when
-            // cbColValues and newCBColValues are freed below
-            buffer = NULL;
-            free((void*) converted_buffer);
-            colResult = NULL;
+            for (i = 0; i < rows.size; i++)
+            {
+                PGRowResult* rowResult = vector_get(&rows, i);
+
+                totalRows++;
+
+                convertRow(uniqueKeyCols,
+                           rowResult->ukValues,
+                           &rowResult->ukTuple,
+                           rowResult->ctid,
+                           rowResult->xmin,
+                           rowResult->rereadKey,
+                           &rowResult->cols,
+                           &writer);
+            }
+
+            // free the batch, but keep the vector for the next one
+            vector_clear(&rows);
         }
 
-        // if passed --report option do not save to db
-        if(!field.report)
+        vector_free(&rows);
+
+        // count the rows skipped by the filter while the read
+        // transaction, if any, is still open
+        if (nonAsciiFilter)
         {
-            // compare pre and post conversion update statements
-            sqlPre = constructWriteQuery(fullTableName,
-                           &cbColValues,
-                           uniqueKeyCols,
-                           uniqueKeyValues);
+            limitReached = (field.limit > 0 && totalRows >= field.limit);
+            rowsVisited = countVisitedRows(fullTableName, uniqueKeyCols, field.restartKey,
+                                           (limitReached ? reader.lastKeyValues : NULL));
+        }
 
+        rowReaderClose(&reader);
+    }
+    else
+    {
+        // expression yielding a row's unique key values as cast literals
+        // built once from the key resolved above
+        ukValuesExpr = constructUkValuesExpr(uniqueKeyCols, uniqueKeyDataTypes);
 
-            sqlPost = constructWriteQuery(fullTableName,
-                           &newCBColValues,
-                           uniqueKeyCols,
-                           uniqueKeyValues);
+        vector_init(&ukTuple, "char*", 0);
 
-            if (strcmp(sqlPre, sqlPost))
-            {
-                rowsUpdated++;
+        // parse and plan the next key query once
+        prepareNextUniqueKeyQuery(fullTableName, uniqueKeyCols,
+                                  ukValuesExpr, ukParamList, ukColCount,
+                                  nonAsciiFilter);
 
-                // write converted data back to same row
-                writeResult = pq_query(writeCxn, sqlPost);
+        if (field.oneRowKey)
+        {
+            uniqueKeyValues = field.oneRowKey;
+            getUniqueKeyTuple(&ukTuple, uniqueKeyValues);
+        }
+        else if (field.restartKey)
+        {
+            uniqueKeyValues = strdup(field.restartKey);
+            getUniqueKeyTuple(&ukTuple, uniqueKeyValues);
+        }
+        else
+        {
+            // get lowest unique key value
+            uniqueKeyValues = getInitUniqueKeyValues(&ukTuple, fullTableName,
+                                uniqueKeyCols, ukValuesExpr, nonAsciiFilter);
+        }
 
-                if (PQresultStatus(writeResult) == PGRES_COMMAND_OK)
-                {
-                   // log success on stdout
-                   if (field.debug)
-                       LOGSTDOUT(DEBUG, PQresStatus(PQresultStatus(writeResult)),
-                           "%s.%s, %s=%s updated.\n",
-                           field.schema, field.table, uniqueKeyCols, uniqueKeyValues);
+        // convert until no more rows
+        while (uniqueKeyValues != NULL)
+        {
+            totalRows++;
 
-                   exitCode = EXIT_SUCCESS;
-                }
-                else
-                {
-                   // log failure on stderr
-                   LOGSTDOUT(ERROR, PQresStatus(PQresultStatus(writeResult)),
-                       "%s.%s, %s=%s update failed.\n",
-                       field.schema, field.table, uniqueKeyCols, uniqueKeyValues);
+            if (field.limit > 0 && field.limit < totalRows)
+            {
+                totalRows--;
+                limitReached = true;
+                break;
+            }
 
-                   exitCode = EXIT_FAILURE;
-                }
+            // initialize values vector to appropriate size
+            vector_init(&cbColValues, "PGColResult*", cbColNames.size);
+
+            // get row to convert
+            getCBColValues(&cbColValues, &rowCtid, &rowXmin, &ukTuple,
+                           uniqueKeyValues, cbColFields);
 
-                PQclear(writeResult);
+            // a row another transaction holds is deferred rather than
+            // waited on
+            if (rowCtid == NULL && field.skipLocked &&
+                rowExists(&ukTuple, uniqueKeyValues))
+            {
+                rowWriterDefer(&writer, uniqueKeyValues, &ukTuple);
             }
             else
             {
-                LOGSTDERR(INFO, "NO_CONVERSION",
-                    "No columns require conversion - skipping update of %s=%s.",
-                     uniqueKeyCols, uniqueKeyValues);
+                convertRow(uniqueKeyCols,
+                           uniqueKeyValues,
+                           &ukTuple,
+                           rowCtid,
+                           rowXmin,
+                           NULL,
+                           &cbColValues,
+                           &writer);
+            }
 
-                 exitCode = EXIT_SUCCESS;
+            // free the column data
+            vector_free(&cbColValues);
+            free((void *) rowCtid);
+            free((void *) rowXmin);
+            rowCtid = NULL;
+            rowXmin = NULL;
+
+            // the last row read bounds the rows visited under --limit
+            if (nonAsciiFilter)
+            {
+                free(prevUniqueKeyValues);
+                prevUniqueKeyValues = strdup(uniqueKeyValues);
             }
 
-            free ((void *) sqlPre);
-            free ((void *) sqlPost);
-        }
+            if (field.oneRowKey)
+            {
+                break;
+            }
+            else
+            {
+                nextKeyValues = getNextUniqueKeyValues(&ukTuple);
+                free(uniqueKeyValues);
+                uniqueKeyValues = nextKeyValues;
+            }
+        } // while (uniqueKeyValues != NULL)
 
-        // free the column data and converted data buffers
-        vector_free(&cbColValues);
-        vector_free(&newCBColValues);
+        vector_free(&ukTuple);
 
-        if (field.oneRowKey)
-        {
-            break;
-        }
-        else
-        {
-            nextKeyValues = getNextUniqueKeyValues(field.schema, field.table,
-                    uniqueKeyCols, uniqueKeyValues);
-            free(uniqueKeyValues);
-            uniqueKeyValues = nextKeyValues;
-        }
-    } // while (uniqueKeyValues != NULL)
+        if (nonAsciiFilter)
+            rowsVisited = countVisitedRows(fullTableName, uniqueKeyCols, field.restartKey,
+                                           (limitReached ? prevUniqueKeyValues : NULL));
+    }
+
+    // re-read the rows an application changed between their read and
+    // write, or held locked
+    if (rereadRows && !field.report && field.mode != MODE_REBUILD)
+        retryConflicts(uniqueKeyCols, rereadKeyCols, cbColFields, &writer);
+
+    if (cbColFields)
+        PQclear(cbColFields);
+
+    if (field.mode != MODE_REBUILD)
+    {
+        // write the rows still waiting in batches
+        rowWriterClose(&writer);
+
+        rowsUpdated += writer.rowsUpdated;
+
+        // any row that failed to update fails the run
+        if (writer.rowsFailed > 0)
+            exitCode = EXIT_FAILURE;
+    }
+
+    // without a filter every row visited was read
+    if (!nonAsciiFilter)
+        rowsVisited = totalRows;
 
     // cleanup after ourselves
     vector_free(&cbColNames);
@@ -342,8 +641,15 @@ int main (int argc, char** argv)
     free((void *) uniqueKeyColsCast);
     free((void *) uniqueKeyCols);
     free((void *) uniqueKeyDataTypes);
+    free((void *) ukValuesExpr);
+    free((void *) rereadKeyColsCast);
+    free((void *) rereadKeyCols);
+    free((void *) rereadKeyDataTypes);
+    free((void *) rereadKeyExpr);
+    free((void *) ukParamList);
     free((void *) uniqueKeyValues);
     free((void *) prevUniqueKeyValues);
+    free((void *) nonAsciiFilter);
     free((void *) conversionLogHeader);
 
     LOGSTDERR(INFO, PQresStatus(PGRES_COMMAND_OK),
@@ -357,11 +663,17 @@ int main (int argc, char** argv)
     fprintf(stderr, "\n");
     fprintf(stderr, "===============================\n");
     fprintf(stderr, " Run time (secs):  %'.6f\n", runtime);
-    fprintf(stderr, " Total rows:       %'ld\n", totalRows);
+    fprintf(stderr, " Total rows:       %'ld\n", rowsVisited);
+    if (field.nonAsciiOnly)
+        fprintf(stderr, " Non-ASCII rows:   %'ld\n", totalRows);
     fprintf(stderr, " Rows updated:     %'ld\n", rowsUpdated);
-    fprintf(stderr, " %% updated:        %'.02f\n", (100.0 * rowsUpdated/totalRows));
+    fprintf(stderr, " ASCII values:     %'ld\n", transcodeAsciiValues());
+    if (field.trustUtf8)
+        fprintf(stderr, " UTF-8 values:     %'ld\n", transcodeUtf8Values());
+    fprintf(stderr, " Table values:     %'ld\n", transcodeTableValues());
+    fprintf(stderr, " %% updated:        %'.02f\n", (100.0 * rowsUpdated/rowsVisited));
     if (runtime)
-        fprintf(stderr, " Avg rows/sec:     %.2f\n", totalRows/runtime);
+        fprintf(stderr, " Avg rows/sec:     %.2f\n", rowsVisited/runtime);
     else
         fprintf(stderr, " *All* the rows in %.6f seconds!\n", runtime);
     fprintf(stderr, "===============================\n");
@@ -0,0 +1,802 @@
+/*
+ * reader.c
+ *
+ * Row readers that fetch the unique key and character-based column
+ * values of many rows per round trip
+ *
+ * Copyright © 2015, AWeber Communications.
+ * All rights reserved.
+ */
+
+// pick up vasprintf
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "reader.h"
+#include "transcoder.h"
+#include "transcoder-utils.h"
+#include "log.h"
+
+char* constructBatchReadQuery(const Vector* cbColNames,
+                              const char* uniqueKeyCols,
+                              const char* uniqueKeyDataTypes,
+                              const char* rereadKeyExpr)
+{
+/* construct batch read query from the unique key and character-based column names
+
+    "select <uk values expr> as uk_values, <uk cols>::text, ctid::text, xmin::text,"
+    "       <reread key values expr> as reread_key, <colnames>"
+    "  from %s"
+    "%s"                        -- optional " where (<uk cols>) > (<last uk values>) and <filter>"
+    " order by %s"
+    "%s"                        -- optional " limit <n>"
+*/
+
+    char* ukExpr = NULL;
+    char* ukTextCols = NULL;
+    char* cbCols = NULL;
+    char* sql = NULL;
+    char* tmp = NULL;
+
+    ukExpr = constructUkValuesExpr(uniqueKeyCols, uniqueKeyDataTypes);
+
+    sql = concat("select ", ukExpr, " as uk_values", (char*) NULL);
+
+    // the raw key columns let the reader carry the last key forward
+    // as a typed tuple, and the writer bind or copy each row's key.
+    // they're cast to text so every column can be read in binary format
+    ukTextCols = constructUkTextCols(uniqueKeyCols);
+
+    // the row's ctid lets the writer apply batches in physical order,
+    // and with its xmin, check under --optimistic the row wasn't changed
+    tmp = sql;
+    sql = concat(tmp, ", ", ukTextCols, ", ctid::text, xmin::text", (char*) NULL);
+    free((void *) tmp);
+    free((void *) ukTextCols);
+
+    // under --scan=ctid, the table's unique key, if it has one, to re-read
+    // a row by if it's changed before it's written
+    tmp = sql;
+    sql = concat(tmp, ", ", (rereadKeyExpr ? rereadKeyExpr : "null::text"), " as reread_key",
+                 (char*) NULL);
+    free((void *) tmp);
+
+    cbCols = constructCBColList(cbColNames);
+
+    tmp = sql;
+    sql = concat(tmp, ", ", cbCols, (char*) NULL);
+    free((void *) tmp);
+    free((void *) cbCols);
+
+    tmp = sql;
+    sql = concat(tmp, "  from %s%s order by %s%s", (char*) NULL);
+    free((void *) tmp);
+
+    free((void *) ukExpr);
+
+    if (field.debug)
+    {
+        LOGSTDERR(DEBUG, "Batch Read SQL Query",
+                "%s", sql);
+    }
+
+    // free in caller
+    return sql;
+}
+
+// construct the optional where and limit clauses of the batch read query.
+// the where clause compares against the key as cast literals for the
+// one-off cursor and copy queries, and against the bound key tuple for
+// the repeated keyset query, and adds the reader's filter, if any
+static void constructBatchClauses(const RowReader* rr, unsigned long limit,
+                                  char** where, char** limitClause)
+{
+    if (rr->lastKeyValues)
+    {
+        if (asprintf(where, " where (%s) %s (%s)%s%s",
+                     rr->uniqueKeyCols,
+                     (rr->inclusive ? ">=" : ">"),
+                     (rr->scan == SCAN_KEYSET ? rr->ukParamList : rr->lastKeyValues),
+                     (rr->filter ? " and " : ""),
+                     (rr->filter ? rr->filter : "")) < 0)
+        {
+            perror("asprintf - where");
+            clean_exit(EXIT_FAILURE);
+        }
+    }
+    else if (rr->filter)
+    {
+        *where = concat(" where ", rr->filter, (char*) NULL);
+    }
+    else
+    {
+        *where = strdup("");
+    }
+
+    if (limit > 0)
+    {
+        if (asprintf(limitClause, " limit %lu", limit) < 0)
+        {
+            perror("asprintf - limit");
+            clean_exit(EXIT_FAILURE);
+        }
+    }
+    else
+    {
+        *limitClause = strdup("");
+    }
+}
+
+// open a read-only transaction on the read connection and declare a
+// binary server-side cursor over the whole (remaining) table in unique
+// key order
+static void openCursor(RowReader* rr)
+{
+    PGresult* readResult = NULL;
+    char* where = NULL;
+    char* limitClause = NULL;
+    char* declare = NULL;
+
+    readResult = pq_query(rr->cxn, "begin transaction read only;");
+
+    if (PQresultStatus(readResult) != PGRES_COMMAND_OK)
+    {
+        LOGSTDERR(ERROR, PQerrorMessage(rr->cxn),
+            "Cannot begin read transaction for cursor %s", READER_CURSOR_NAME);
+        clean_exit(EXIT_FAILURE);
+    }
+
+    PQclear(readResult);
+
+    constructBatchClauses(rr, rr->remaining, &where, &limitClause);
+
+    // the cursor does the --limit, so the reader doesn't have to
+    rr->remaining = 0;
+
+    declare = concat("declare " READER_CURSOR_NAME " binary no scroll cursor for ",
+                     rr->query, (char*) NULL);
+
+    readResult = pq_vaquery(rr->cxn, declare,
+                            rr->fullTableName,
+                            where,
+                            rr->uniqueKeyCols,
+                            limitClause);
+
+    if (PQresultStatus(readResult) != PGRES_COMMAND_OK)
+    {
+        LOGSTDERR(ERROR, PQerrorMessage(rr->cxn),
+            "Declare cursor failed: %s", declare);
+        clean_exit(EXIT_FAILURE);
+    }
+
+    PQclear(readResult);
+
+    free((void *) declare);
+    free((void *) where);
+    free((void *) limitClause);
+}
+
+// start a binary COPY (select ...) TO STDOUT of the whole (remaining)
+// table in unique key order.  COPY doesn't describe the columns it sends,
+// so get the column descriptions from an empty binary result of the same
+// query first.
+static void openCopy(RowReader* rr)
+{
+    PGresult* readResult = NULL;
+    char* where = NULL;
+    char* limitClause = NULL;
+    char* copy = NULL;
+
+    rr->copyFields = pq_vaqueryparams(rr->cxn, 0, NULL, BINARY_RESULTS,
+                                rr->query,
+                                rr->fullTableName,
+                                " where false",
+                                rr->uniqueKeyCols,
+                                "");
+
+    if (PQresultStatus(rr->copyFields) != PGRES_TUPLES_OK)
+    {
+        LOGSTDERR(ERROR, PQerrorMessage(rr->cxn),
+            "Describe copy columns query failed: %s", rr->query);
+        clean_exit(EXIT_FAILURE);
+    }
+
+    constructBatchClauses(rr, rr->remaining, &where, &limitClause);
+
+    // the copy query does the --limit, so the reader doesn't have to
+    rr->remaining = 0;
+
+    copy = concat("copy (", rr->query, ") to stdout with (format binary);", (char*) NULL);
+
+    readResult = pq_vaquery(rr->cxn, copy,
+                            rr->fullTableName,
+                            where,
+                            rr->uniqueKeyCols,
+                            limitClause);
+
+    if (PQresultStatus(readResult) != PGRES_COPY_OUT)
+    {
+        LOGSTDERR(ERROR, PQerrorMessage(rr->cxn),
+            "Copy to stdout failed: %s", copy);
+        clean_exit(EXIT_FAILURE);
+    }
+
+    PQclear(readResult);
+
+    free((void *) copy);
+    free((void *) where);
+    free((void *) limitClause);
+}
+
+// read up to batchSize rows of COPY binary format data and append them to
+// rows.  each row is a 16 bit field count, then for each field a 32 bit
+// length, -1 for NULL, and that many bytes.  the file header comes in
+// front of the first row, and a field count of -1 ends the data
+static int readCopyRows(RowReader* rr, Vector* rows, unsigned long batchSize)
+{
+    PGresult* readResult = NULL;
+    char* buf = NULL;
+    int len = 0;
+    int readRecCount = 0;
+    int readColCount = PQnfields(rr->copyFields);
+    int parsed = 0;
+    int col = 0;
+    int i = 0;
+
+    // fields of the current row; length -1 is NULL
+    const char** values = calloc(readColCount, sizeof(char*));
+    long* lengths = calloc(readColCount, sizeof(long));
+
+    while ((unsigned long) readRecCount < batchSize)
+    {
+        // one call returns one row
+        len = PQgetCopyData(rr->cxn, &buf, 0);
+
+        if (len == -1)
+        {
+            // copy is done, check how it ended
+            while ((readResult = PQgetResult(rr->cxn)) != NULL)
+            {
+                if (PQresultStatus(readResult) != PGRES_COMMAND_OK)
+                {
+                    LOGSTDERR(ERROR, PQerrorMessage(rr->cxn),
+                        "Copy to stdout failed: %s", rr->query);
+                    clean_exit(EXIT_FAILURE);
+                }
+
+                PQclear(readResult);
+            }
+
+            rr->exhausted = true;
+            break;
+        }
+        else if (len < 0)
+        {
+            LOGSTDERR(ERROR, PQerrorMessage(rr->cxn),
+                "Copy to stdout failed: %s", rr->query);
+            clean_exit(EXIT_FAILURE);
+        }
+
+        parsed = parseCopyRow(buf, len, &rr->copyHeaderRead, readColCount, values, lengths);
+
+        if (parsed == 0)
+        {
+            // trailer; the next call ends the copy
+            PQfreemem((void *) buf);
+            continue;
+        }
+        else if (parsed < 0)
+        {
+            LOGSTDERR(ERROR, "BAD_COPY_DATA",
+                "Copy to stdout sent a malformed row: %s", rr->query);
+            clean_exit(EXIT_FAILURE);
+        }
+
+        PGRowResult* rowResult = malloc(sizeof(PGRowResult));
+
+        // first column is the unique key values, which are never NULL,
+        // then the raw key columns, the ctid, the xmin and the reread key
+        rowResult->ukValues = (lengths[0] < 0 ? strdup("NULL") : strndup(values[0], lengths[0]));
+
+        vector_init(&rowResult->ukTuple, "char*", rr->keyColCount);
+
+        for (col = 1; col <= rr->keyColCount; col++)
+            vector_append(&rowResult->ukTuple,
+                (lengths[col] < 0 ? NULL : (void *) strndup(values[col], lengths[col])));
+
+        col = 1 + rr->keyColCount;
+        rowResult->ctid = (lengths[col] < 0 ? NULL : strndup(values[col], lengths[col]));
+
+        col = 2 + rr->keyColCount;
+        rowResult->xmin = (lengths[col] < 0 ? NULL : strndup(values[col], lengths[col]));
+
+        col = 3 + rr->keyColCount;
+        rowResult->rereadKey = (lengths[col] < 0 ? NULL : strndup(values[col], lengths[col]));
+
+        vector_init(&rowResult->cols, "PGColResult*", readColCount - 4 - rr->keyColCount);
+
+        if (rr->cbColFields)
+        {
+            // value and flag pairs; only the flagged values were sent,
+            // see constructCBColList()
+            for (i = 0, col = 4 + rr->keyColCount; col + 1 < readColCount; i++, col += 2)
+            {
+                if (lengths[col + 1] != 1 || values[col + 1][0] != 1)
+                    continue;
+
+                vector_append(&rowResult->cols,
+                    (void *) newColResultFromField(rr->cbColFields, i,
+                                values[col], lengths[col], false));
+            }
+        }
+        else
+        {
+            for (col = 4 + rr->keyColCount; col < readColCount; col++)
+                vector_append(&rowResult->cols,
+                    (void *) newColResultFromField(rr->copyFields, col,
+                                (lengths[col] < 0 ? "" : values[col]),
+                                (lengths[col] < 0 ? 0 : lengths[col]),
+                                (lengths[col] < 0)));
+        }
+
+        vector_append(rows, (void *) rowResult);
+
+        PQfreemem((void *) buf);
+        readRecCount++;
+    }
+
+    free((void *) values);
+    free((void *) lengths);
+
+    return readRecCount;
+}
+
+// prepare the keyset query for every batch after the first, i.e.
+// "... where (<uk cols>) > ($1::<type>, ...) order by <uk cols> limit $n",
+// so it is parsed and planned once
+static void prepareKeysetNext(RowReader* rr)
+{
+    char* where = NULL;
+    char* limitClause = NULL;
+
+    if (asprintf(&where, " where (%s) > (%s)%s%s", rr->uniqueKeyCols, rr->ukParamList,
+                 (rr->filter ? " and " : ""), (rr->filter ? rr->filter : "")) < 0 ||
+        asprintf(&limitClause, " limit $%d::bigint", rr->keyColCount + 1) < 0)
+    {
+        perror("asprintf - prepare keyset");
+        clean_exit(EXIT_FAILURE);
+    }
+
+    pq_vaprepare(rr->cxn, BATCH_NEXT_STMT_NAME, rr->keyColCount + 1,
+                 rr->query,
+                 rr->fullTableName,
+                 where,
+                 rr->uniqueKeyCols,
+                 limitClause);
+
+    free((void *) where);
+    free((void *) limitClause);
+}
+
+// run the prepared keyset query for the batch after rr->lastKey
+static PGresult* execKeysetNext(RowReader* rr, unsigned long batchSize)
+{
+    PGresult* readResult = NULL;
+    const char** params = NULL;
+    char limit[24] = {0};
+    int i = 0;
+
+    snprintf(limit, sizeof(limit), "%lu", batchSize);
+
+    params = calloc(rr->keyColCount + 1, sizeof(char*));
+
+    for (i = 0; i < rr->keyColCount; i++)
+        params[i] = (const char*) rr->lastKey.data[i];
+
+    params[rr->keyColCount] = limit;
+
+    readResult = pq_execprepared(rr->cxn, BATCH_NEXT_STMT_NAME,
+                                 rr->keyColCount + 1, params, BINARY_RESULTS);
+
+    free((void *) params);
+
+    // free result in caller
+    return readResult;
+}
+
+// open a repeatable read, read-only transaction on the read connection
+// for the ctid scan.  its snapshot keeps the new row versions written
+// behind the scan from being read again in a later block range.
+static void openCtid(RowReader* rr)
+{
+    PGresult* readResult = NULL;
+    char* where = NULL;
+
+    readResult = pq_query(rr->cxn,
+        "begin transaction isolation level repeatable read read only;");
+
+    if (PQresultStatus(readResult) != PGRES_COMMAND_OK)
+    {
+        LOGSTDERR(ERROR, PQerrorMessage(rr->cxn),
+            "Cannot begin read transaction for ctid scan of %s", rr->fullTableName);
+        clean_exit(EXIT_FAILURE);
+    }
+
+    PQclear(readResult);
+
+    readResult = pq_vaquery(rr->cxn,
+        "select pg_relation_size('%s'::regclass) / current_setting('block_size')::bigint;",
+        rr->fullTableName);
+
+    if (PQresultStatus(readResult) != PGRES_TUPLES_OK || PQntuples(readResult) != 1)
+    {
+        LOGSTDERR(ERROR, PQerrorMessage(rr->cxn),
+            "Cannot get number of blocks in %s", rr->fullTableName);
+        clean_exit(EXIT_FAILURE);
+    }
+
+    rr->nblocks = strtoul(PQgetvalue(readResult, 0, 0), NULL, 10);
+
+    PQclear(readResult);
+
+    // --restart with a row's ctid and xmin starts at that row's block
+    if (rr->lastKeyValues)
+    {
+        getUniqueKeyTuple(&rr->lastKey, rr->lastKeyValues);
+
+        if (rr->lastKey.size < 1 || rr->lastKey.data[0] == NULL ||
+            sscanf((const char*) rr->lastKey.data[0], "(%lu,", &rr->nextBlock) != 1)
+        {
+            LOGSTDERR(ERROR, "INVALID_RESTART_KEY",
+                "Cannot get a ctid from restart key %s", rr->lastKeyValues);
+            clean_exit(EXIT_FAILURE);
+        }
+    }
+
+    where = concat(" where ctid >= $1::tid and ctid < $2::tid",
+                   (rr->filter ? " and " : ""), (rr->filter ? rr->filter : ""),
+                   (char*) NULL);
+
+    // lower and upper ctid of the range, and --limit or NULL for no limit
+    pq_vaprepare(rr->cxn, CTID_RANGE_STMT_NAME, 3,
+                 rr->query,
+                 rr->fullTableName,
+                 where,
+                 rr->uniqueKeyCols,
+                 " limit $3::bigint");
+
+    free((void *) where);
+
+    if (field.debug)
+        LOGSTDERR(DEBUG, PQresStatus(PGRES_COMMAND_OK),
+            "Scanning %lu blocks of %s, %lu at a time, from block %lu",
+            rr->nblocks, rr->fullTableName, rr->batchSize, rr->nextBlock);
+}
+
+// read the next non-empty range of heap blocks.  returns NULL when
+// there are no more blocks to read
+static PGresult* readCtidRange(RowReader* rr)
+{
+    PGresult* readResult = NULL;
+    char lower[48] = {0};
+    char upper[48] = {0};
+    char limit[24] = {0};
+    const char* params[3] = {lower, upper, NULL};
+
+    while (rr->nextBlock < rr->nblocks)
+    {
+        // the first range after --restart starts at the restart row
+        if (rr->inclusive)
+            snprintf(lower, sizeof(lower), "%s", (const char*) rr->lastKey.data[0]);
+        else
+            snprintf(lower, sizeof(lower), "(%lu,0)", rr->nextBlock);
+
+        snprintf(upper, sizeof(upper), "(%lu,0)", rr->nextBlock + rr->batchSize);
+
+        if (rr->remaining > 0)
+        {
+            snprintf(limit, sizeof(limit), "%lu", rr->remaining);
+            params[2] = limit;
+        }
+
+        readResult = pq_execprepared(rr->cxn, CTID_RANGE_STMT_NAME, 3, params,
+                                     BINARY_RESULTS);
+
+        if (PQresultStatus(readResult) != PGRES_TUPLES_OK)
+        {
+            LOGSTDERR(ERROR, PQerrorMessage(rr->cxn),
+                "Ctid range read failed: %s..%s", lower, upper);
+            clean_exit(EXIT_FAILURE);
+        }
+
+        rr->nextBlock += rr->batchSize;
+        rr->inclusive = false;
+
+        if (PQntuples(readResult) > 0)
+            return readResult;
+
+        PQclear(readResult);
+        readResult = NULL;
+    }
+
+    return NULL;
+}
+
+void rowReaderOpen(RowReader* rr, int scan, PGconn* cxn,
+                   const char* fullTableName,
+                   const char* uniqueKeyCols,
+                   const char* uniqueKeyDataTypes,
+                   const Vector* cbColNames,
+                   const char* rereadKeyExpr,
+                   const char* filter,
+                   const char* startKeyValues,
+                   unsigned long batchSize,
+                   unsigned long limit)
+{
+    memset(rr, 0, sizeof(RowReader));
+
+    rr->scan          = scan;
+    rr->cxn           = cxn;
+    rr->fullTableName = fullTableName;
+    rr->uniqueKeyCols = uniqueKeyCols;
+    rr->ukParamList   = constructUkParamList(uniqueKeyDataTypes);
+    rr->filter        = filter;
+    rr->batchSize     = (batchSize > 0 ? batchSize : 1);
+    rr->remaining     = limit;
+    rr->exhausted     = false;
+
+    vector_init(&rr->lastKey, "char*", 0);
+
+    Vector keyCols;
+    rr->keyColCount = splitString(&keyCols, uniqueKeyCols, ", ");
+    vector_free(&keyCols);
+
+    rr->query = constructBatchReadQuery(cbColNames, uniqueKeyCols, uniqueKeyDataTypes,
+                                        rereadKeyExpr);
+
+    // --skip-ascii-columns selects the values through case expressions,
+    // so describe the plain columns
+    if (field.skipAsciiColumns)
+        rr->cbColFields = describeCBCols(cbColNames, fullTableName);
+
+    // start at the restart key, inclusive, or at the beginning of the table
+    if (startKeyValues)
+    {
+        rr->lastKeyValues = strdup(startKeyValues);
+        rr->inclusive = true;
+
+        if (rr->scan == SCAN_KEYSET)
+            getUniqueKeyTuple(&rr->lastKey, startKeyValues);
+    }
+
+    if (rr->scan == SCAN_KEYSET)
+        prepareKeysetNext(rr);
+    else if (rr->scan == SCAN_CURSOR)
+        openCursor(rr);
+    else if (rr->scan == SCAN_COPY)
+        openCopy(rr);
+    else if (rr->scan == SCAN_CTID)
+        openCtid(rr);
+}
+
+// append the next batch of rows to the rows vector, which must be
+// initialized with type "PGRowResult*".  returns the number of rows
+// appended; 0 when there are no more rows.
+unsigned int rowReaderNext(RowReader* rr, Vector* rows)
+{
+    // query results
+    PGresult *readResult = NULL;
+
+    // rows
+    int row = 0;
+
+    // records processed
+    int readRecCount = 0;
+    int readColCount = 0;
+
+    unsigned long batchSize = rr->batchSize;
+    char* where = NULL;
+    char* limitClause = NULL;
+
+    if (rr->exhausted)
+        return 0;
+
+    // don't read past --limit
+    if (rr->remaining > 0 && rr->remaining < batchSize && rr->scan != SCAN_CTID)
+        batchSize = rr->remaining;
+
+    if (rr->scan == SCAN_CTID)
+    {
+        readResult = readCtidRange(rr);
+
+        if (readResult == NULL)
+        {
+            rr->exhausted = true;
+            return 0;
+        }
+    }
+    else if (rr->scan == SCAN_COPY)
+    {
+        readRecCount = readCopyRows(rr, rows, batchSize);
+
+        if (field.debug)
+            LOGSTDERR(DEBUG, PQresStatus(PGRES_COPY_OUT),
+                "Copy read %d %s after %s", readRecCount,
+                (readRecCount == 1 ? "row" : "rows"),
+                (rr->lastKeyValues ? rr->lastKeyValues : "start of table"));
+
+        if (readRecCount > 0)
+        {
+            PGRowResult* last = vector_get(rows, rows->size - 1);
+            free((void *) rr->lastKeyValues);
+            rr->lastKeyValues = strdup(last->ukValues);
+            rr->inclusive = false;
+        }
+
+        return readRecCount;
+    }
+    else if (rr->scan == SCAN_CURSOR)
+    {
+        readResult = pq_vaquery(rr->cxn, "fetch forward %lu from " READER_CURSOR_NAME ";",
+                                batchSize);
+    }
+    else if (rr->lastKeyValues && !rr->inclusive)
+    {
+        readResult = execKeysetNext(rr, batchSize);
+    }
+    else
+    {
+        // first batch, from the start of the table or the restart key
+        constructBatchClauses(rr, batchSize, &where, &limitClause);
+
+        readResult = pq_vaqueryparams(rr->cxn,
+                                (rr->lastKeyValues ? rr->lastKey.size : 0),
+                                (const char* const*) rr->lastKey.data,
+                                BINARY_RESULTS,
+                                rr->query,
+                                rr->fullTableName,
+                                where,
+                                rr->uniqueKeyCols,
+                                limitClause);
+
+        free((void *) where);
+        free((void *) limitClause);
+    }
+
+    if (PQresultStatus(readResult) != PGRES_TUPLES_OK)
+    {
+        LOGSTDERR(ERROR, PQerrorMessage(rr->cxn),
+            "Batch read query failed: %s", rr->query);
+        clean_exit(EXIT_FAILURE);
+    }
+
+    readRecCount = PQntuples(readResult);
+    readColCount = PQnfields(readResult);
+
+    if (field.debug)
+        LOGSTDERR(DEBUG, PQresStatus(PQresultStatus(readResult)),
+            "Batch read %d %s after %s", readRecCount,
+            (readRecCount == 1 ? "row" : "rows"),
+            (rr->lastKeyValues ? rr->lastKeyValues : "start of table"));
+
+    // first column is the unique key values, then the raw key columns,
+    // the ctid, the xmin and the reread key, and the rest are the
+    // character-based columns
+    for (row = 0; row < readRecCount; row++)
+    {
+        PGRowResult* rowResult = malloc(sizeof(PGRowResult));
+
+        rowResult->ukValues = strdup(PQgetvalue(readResult, row, 0));
+
+        vector_init(&rowResult->ukTuple, "char*", rr->keyColCount);
+        setUniqueKeyTuple(&rowResult->ukTuple, readResult, row, 1, rr->keyColCount);
+
+        rowResult->ctid = (PQgetisnull(readResult, row, 1 + rr->keyColCount) ? NULL :
+                            strdup(PQgetvalue(readResult, row, 1 + rr->keyColCount)));
+
+        rowResult->xmin = (PQgetisnull(readResult, row, 2 + rr->keyColCount) ? NULL :
+                            strdup(PQgetvalue(readResult, row, 2 + rr->keyColCount)));
+
+        rowResult->rereadKey = (PQgetisnull(readResult, row, 3 + rr->keyColCount) ? NULL :
+                            strdup(PQgetvalue(readResult, row, 3 + rr->keyColCount)));
+
+        vector_init(&rowResult->cols, "PGColResult*", readColCount - 4 - rr->keyColCount);
+
+        appendCBColResults(&rowResult->cols, readResult, row, 4 + rr->keyColCount,
+                           rr->cbColFields);
+
+        vector_append(rows, (void *) rowResult);
+    }
+
+    // carry the last key forward as the cursor for the next batch
+    if (readRecCount > 0)
+    {
+        free((void *) rr->lastKeyValues);
+        rr->lastKeyValues = strdup(PQgetvalue(readResult, readRecCount - 1, 0));
+        rr->inclusive = false;
+
+        setUniqueKeyTuple(&rr->lastKey, readResult, readRecCount - 1, 1, rr->keyColCount);
+    }
+
+    // a short batch means we've reached the end of the table
+    if (rr->scan == SCAN_CTID)
+    {
+        if (rr->nextBlock >= rr->nblocks)
+            rr->exhausted = true;
+    }
+    else if ((unsigned long) readRecCount < batchSize)
+    {
+        rr->exhausted = true;
+    }
+
+    if (rr->remaining > 0)
+    {
+        rr->remaining -= readRecCount;
+
+        if (rr->remaining == 0)
+            rr->exhausted = true;
+    }
+
+    PQclear(readResult);
+
+    return readRecCount;
+}
+
+void rowReaderClose(RowReader* rr)
+{
+    PGresult* readResult = NULL;
+
+    // closing the transaction closes the cursor, or the ctid scan's snapshot
+    if ((rr->scan == SCAN_CURSOR || rr->scan == SCAN_CTID) && rr->query)
+    {
+        readResult = pq_query(rr->cxn, "commit;");
+
+        if (PQresultStatus(readResult) != PGRES_COMMAND_OK)
+            LOGSTDERR(WARNING, PQerrorMessage(rr->cxn),
+                "Cannot end read transaction of %s scan", rr->fullTableName);
+
+        PQclear(readResult);
+    }
+
+    // drain a copy that was stopped early; libpq has no way to cancel
+    // the rest of a COPY TO STDOUT short of cancelling the query
+    if (rr->scan == SCAN_COPY && rr->query && !rr->exhausted)
+    {
+        char errbuf[256] = {0};
+        PGcancel* cancel = PQgetCancel(rr->cxn);
+
+        if (cancel)
+        {
+            PQcancel(cancel, errbuf, sizeof(errbuf));
+            PQfreeCancel(cancel);
+        }
+
+        char* buf = NULL;
+
+        while (PQgetCopyData(rr->cxn, &buf, 0) >= 0)
+            PQfreemem((void *) buf);
+
+        while ((readResult = PQgetResult(rr->cxn)) != NULL)
+            PQclear(readResult);
+    }
+
+    if (rr->copyFields)
+        PQclear(rr->copyFields);
+
+    if (rr->cbColFields)
+        PQclear(rr->cbColFields);
+
+    free((void *) rr->query);
+    free((void *) rr->lastKeyValues);
+    free((void *) rr->ukParamList);
+    vector_free(&rr->lastKey);
+
+    rr->ukParamList = NULL;
+    rr->copyFields = NULL;
+    rr->cbColFields = NULL;
+    rr->query = NULL;
+    rr->lastKeyValues = NULL;
+    rr->exhausted = true;
+}
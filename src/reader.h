@@ -0,0 +1,72 @@
+/*
+ * reader.h
+ *
+ * Row readers that fetch the unique key and character-based column
+ * values of many rows per round trip
+ *
+ * Copyright © 2015, AWeber Communications.
+ * All rights reserved.
+ */
+
+#ifndef _READER_H_
+#define _READER_H_
+
+#include <libpq-fe.h>
+#include <stdbool.h>
+
+#include "vector.h"
+#include "colresult.h"
+
+// name of the server-side cursor used by --scan=cursor
+#define READER_CURSOR_NAME "transcoder_cursor"
+
+// name of the statement prepared for the keyset batches after the first
+#define BATCH_NEXT_STMT_NAME "transcoder_batch_next"
+
+// name of the statement prepared for the heap block ranges of --scan=ctid
+#define CTID_RANGE_STMT_NAME "transcoder_ctid_range"
+
+typedef struct
+{
+    int             scan;           // SCAN_KEYSET, SCAN_CURSOR, SCAN_COPY or SCAN_CTID, see --scan
+    PGconn*         cxn;            // read connection
+    const char*     fullTableName;  // schema-qualified table name
+    const char*     uniqueKeyCols;  // shortest unique key column(s), comma separated
+    char*           query;          // batch read query, see constructBatchReadQuery()
+    char*           lastKeyValues;  // key of the last row returned; NULL before the first batch
+    Vector          lastKey;        // lastKeyValues as a typed tuple, bound as parameters by SCAN_KEYSET
+    int             keyColCount;    // unique key columns selected after uk_values
+    char*           ukParamList;    // "$1::<type>, ..." for the unique key, see constructUkParamList()
+    const char*     filter;         // predicate rows must pass to be read, e.g. --non-ascii-only; NULL for none
+    bool            inclusive;      // include lastKeyValues itself in the next batch, i.e. --restart
+    unsigned long   batchSize;      // rows per round trip, per FETCH for a cursor, or heap blocks per ctid range
+    unsigned long   remaining;      // rows left to read under --limit; 0 means no limit
+    bool            exhausted;      // no more rows to read
+    PGresult*       copyFields;     // column descriptions for rows read with COPY
+    bool            copyHeaderRead; // binary COPY file header has been read
+    PGresult*       cbColFields;    // plain character-based column descriptions for --skip-ascii-columns; NULL otherwise
+    unsigned long   nextBlock;      // first heap block of the next ctid range
+    unsigned long   nblocks;        // heap blocks in the table when the ctid scan started
+} RowReader;
+
+char* constructBatchReadQuery(const Vector* cbColNames,
+                              const char* uniqueKeyCols,
+                              const char* uniqueKeyDataTypes,
+                              const char* rereadKeyExpr);
+
+void rowReaderOpen(RowReader* rr, int scan, PGconn* cxn,
+                   const char* fullTableName,
+                   const char* uniqueKeyCols,
+                   const char* uniqueKeyDataTypes,
+                   const Vector* cbColNames,
+                   const char* rereadKeyExpr,
+                   const char* filter,
+                   const char* startKeyValues,
+                   unsigned long batchSize,
+                   unsigned long limit);
+
+unsigned int rowReaderNext(RowReader* rr, Vector* rows);
+
+void rowReaderClose(RowReader* rr);
+
+#endif // #ifndef _READER_H_
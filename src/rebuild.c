@@ -0,0 +1,967 @@
+/*
+ * rebuild.c
+ *
+ * Table rebuilds that stream every row through the transcoder into a
+ * shadow table with COPY and swap it in for the original
+ *
+ * Copyright © 2015, AWeber Communications.
+ * All rights reserved.
+ */
+
+// pick up vasprintf
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rebuild.h"
+#include "colresult.h"
+#include "transcoder.h"
+#include "transcoder-utils.h"
+#include "log.h"
+
+/* statements that give the shadow table the original's indexes,
+   constraints, triggers, owner and grants, built once the rows are in.
+   indexes and constraints get REBUILD_SHADOW_SUFFIX names until the
+   swap.  foreign keys (step 3) and triggers (step 4) would fire on the
+   catch-up passes' deletes and copies, so they're only added in the
+   swap, after the last replay.  a foreign key the original has validated
+   is added NOT VALID there, so the tables aren't locked while it's
+   checked, and validated once the swap has committed, with the
+   statement in the validate column.  run with an empty search_path, so every name is qualified.
+   positional parameters: schema, table, shadow table name and the
+   schema-qualified table name
+*/
+static const char buildShadowSql[] =
+"select step, ddl, validate from ("
+"  select 1 as step,"
+"         replace(replace(pg_get_indexdef(i.indexrelid),"
+"                 ' INDEX ' || quote_ident(ic.relname) || ' ON ',"
+"                 ' INDEX ' || quote_ident(ic.relname || '" REBUILD_SHADOW_SUFFIX "') || ' ON '),"
+"                 ' ON ' || quote_ident('%1$s') || '.' || quote_ident('%2$s') || ' USING ',"
+"                 ' ON ' || quote_ident('%1$s') || '.' || quote_ident('%3$s') || ' USING ') as ddl,"
+"         null as validate"
+"    from pg_index i"
+"    join pg_class ic on ic.oid = i.indexrelid"
+"   where i.indrelid = '%4$s'::regclass"
+"     and not exists (select 1 from pg_constraint c"
+"                      where c.conindid = i.indexrelid and c.conrelid = i.indrelid)"
+"  union all"
+"  select case when c.contype = 'f' then 3 else 2 end,"
+"         'alter table ' || quote_ident('%1$s') || '.' || quote_ident('%3$s')"
+"         || ' add constraint ' || quote_ident(c.conname || '" REBUILD_SHADOW_SUFFIX "') || ' '"
+"         || case when c.confrelid = c.conrelid"
+"                 then replace(pg_get_constraintdef(c.oid),"
+"                      ' REFERENCES ' || quote_ident('%1$s') || '.' || quote_ident('%2$s') || '(',"
+"                      ' REFERENCES ' || quote_ident('%1$s') || '.' || quote_ident('%3$s') || '(')"
+"                 else pg_get_constraintdef(c.oid) end"
+"         || case when c.contype = 'f' and c.convalidated then ' NOT VALID' else '' end,"
+"         case when c.contype = 'f' and c.convalidated"
+"              then 'alter table ' || quote_ident('%1$s') || '.' || quote_ident('%2$s')"
+"                   || ' validate constraint ' || quote_ident(c.conname) end"
+"    from pg_constraint c"
+"   where c.conrelid = '%4$s'::regclass"
+"     and c.contype in ('p', 'u', 'x', 'f')"
+"  union all"
+"  select 4,"
+"         replace(pg_get_triggerdef(g.oid),"
+"                 ' ON ' || quote_ident('%1$s') || '.' || quote_ident('%2$s') || ' ',"
+"                 ' ON ' || quote_ident('%1$s') || '.' || quote_ident('%3$s') || ' '),"
+"         null"
+"    from pg_trigger g"
+"   where g.tgrelid = '%4$s'::regclass"
+"     and not g.tgisinternal"
+"     and g.tgname <> '" REBUILD_TRIGGER "'"
+"  union all"
+"  select 5,"
+"         'alter table ' || quote_ident('%1$s') || '.' || quote_ident('%3$s')"
+"         || ' owner to ' || quote_ident(pg_get_userbyid(c.relowner)),"
+"         null"
+"    from pg_class c"
+"   where c.oid = '%4$s'::regclass"
+"  union all"
+"  select 6,"
+"         'grant ' || a.privilege_type || ' on ' || quote_ident('%1$s') || '.' || quote_ident('%3$s')"
+"         || ' to ' || case when a.grantee = 0 then 'public'"
+"                           else quote_ident(pg_get_userbyid(a.grantee)) end"
+"         || case when a.is_grantable then ' with grant option' else '' end,"
+"         null"
+"    from pg_class c, aclexplode(c.relacl) a"
+"   where c.oid = '%4$s'::regclass"
+") d order by step;";
+
+/* statements the swap runs with both tables locked: retire before the
+   tables are renamed, giving the original's indexes and constraints
+   REBUILD_OLD_SUFFIX names and moving identity columns past the
+   original's last value, and promote after, giving the shadow's their
+   final names and moving sequences owned by the original's columns,
+   e.g. serial ones, to the shadow's.  same parameters as buildShadowSql
+*/
+static const char swapSql[] =
+"select retire, promote from ("
+"  select 1 as step,"
+"         'alter index ' || quote_ident('%1$s') || '.' || quote_ident(ic.relname)"
+"         || ' rename to ' || quote_ident(ic.relname || '" REBUILD_OLD_SUFFIX "') as retire,"
+"         'alter index ' || quote_ident('%1$s') || '.' || quote_ident(ic.relname || '" REBUILD_SHADOW_SUFFIX "')"
+"         || ' rename to ' || quote_ident(ic.relname) as promote"
+"    from pg_index i"
+"    join pg_class ic on ic.oid = i.indexrelid"
+"   where i.indrelid = '%4$s'::regclass"
+"     and not exists (select 1 from pg_constraint c"
+"                      where c.conindid = i.indexrelid and c.conrelid = i.indrelid)"
+"  union all"
+"  select 2,"
+"         'alter table ' || quote_ident('%1$s') || '.' || quote_ident('%2$s')"
+"         || ' rename constraint ' || quote_ident(c.conname)"
+"         || ' to ' || quote_ident(c.conname || '" REBUILD_OLD_SUFFIX "'),"
+"         'alter table ' || quote_ident('%1$s') || '.' || quote_ident('%2$s')"
+"         || ' rename constraint ' || quote_ident(c.conname || '" REBUILD_SHADOW_SUFFIX "')"
+"         || ' to ' || quote_ident(c.conname)"
+"    from pg_constraint c"
+"   where c.conrelid = '%4$s'::regclass"
+"     and c.contype in ('p', 'u', 'x', 'f')"
+"  union all"
+"  select 3,"
+"         'select setval(pg_get_serial_sequence('"
+"         || quote_literal(quote_ident('%1$s') || '.' || quote_ident('%3$s')) || ', ' || quote_literal(a.attname)"
+"         || '), nextval(pg_get_serial_sequence('"
+"         || quote_literal(quote_ident('%1$s') || '.' || quote_ident('%2$s')) || ', ' || quote_literal(a.attname)"
+"         || ')))',"
+"         null"
+"    from pg_attribute a"
+"   where a.attrelid = '%4$s'::regclass"
+"     and a.attidentity <> ''"
+"     and not a.attisdropped"
+"  union all"
+"  select 4,"
+"         null,"
+"         'alter sequence ' || s.oid::regclass::text || ' owned by '"
+"         || quote_ident('%1$s') || '.' || quote_ident('%2$s') || '.' || quote_ident(a.attname)"
+"    from pg_depend d"
+"    join pg_class s on s.oid = d.objid and s.relkind = 'S'"
+"    join pg_attribute a on a.attrelid = d.refobjid and a.attnum = d.refobjsubid"
+"   where d.classid = 'pg_class'::regclass"
+"     and d.refclassid = 'pg_class'::regclass"
+"     and d.refobjid = '%4$s'::regclass"
+"     and d.deptype = 'a'"
+") d order by step;";
+
+// undo a failed rebuild and exit: end whatever the write connection was
+// doing, drop the log trigger so the application stops paying for it,
+// and drop the log table, its function and the shadow table.  the
+// original table is left as it was
+static void abortRebuild(Rebuild* rb)
+{
+    PGresult* writeResult = NULL;
+
+    // a failed copy leaves the connection copying in
+    if (PQtransactionStatus(rb->writeCxn) == PQTRANS_ACTIVE)
+    {
+        PQputCopyEnd(rb->writeCxn, "transcoder rebuild aborted");
+
+        while ((writeResult = PQgetResult(rb->writeCxn)) != NULL)
+            PQclear(writeResult);
+    }
+
+    writeResult = pq_query(rb->writeCxn, "rollback;");
+    PQclear(writeResult);
+
+    writeResult = pq_vaquery(rb->writeCxn,
+        "drop trigger if exists " REBUILD_TRIGGER " on %s;"
+        " drop function if exists %s();"
+        " drop table if exists %s;",
+        rb->fullTableName, rb->logFunction, rb->logTable);
+
+    if (PQresultStatus(writeResult) != PGRES_COMMAND_OK)
+        LOGSTDERR(ERROR, PQerrorMessage(rb->writeCxn),
+            "Cannot drop trigger " REBUILD_TRIGGER " on %s; drop it by hand",
+            rb->fullTableName);
+
+    PQclear(writeResult);
+
+    if (rb->shadowCreated)
+    {
+        writeResult = pq_vaquery(rb->writeCxn, "drop table if exists %s;", rb->shadowTable);
+        PQclear(writeResult);
+    }
+
+    LOGSTDERR(ERROR, "REBUILD_ABORTED",
+        "Rebuild of %s aborted; the table is unchanged", rb->fullTableName);
+
+    clean_exit(EXIT_FAILURE);
+}
+
+// format and run a statement on the write connection, and abort the
+// rebuild if it fails
+static void rebuildExec(Rebuild* rb, const char* format, ...)
+{
+    PGresult* writeResult = NULL;
+    va_list argv;
+    char* sql = NULL;
+
+    va_start(argv, format);
+    if (vasprintf(&sql, format, argv) < 0)
+        sql = NULL;
+    va_end(argv);
+
+    if (sql == NULL)
+    {
+        perror("vasprintf - rebuild");
+        abortRebuild(rb);
+    }
+
+    writeResult = pq_query(rb->writeCxn, sql);
+
+    if (PQresultStatus(writeResult) != PGRES_COMMAND_OK &&
+        PQresultStatus(writeResult) != PGRES_TUPLES_OK)
+    {
+        LOGSTDERR(ERROR, PQerrorMessage(rb->writeCxn),
+            "Rebuild of %s failed: %s", rb->fullTableName, sql);
+        PQclear(writeResult);
+        free((void *) sql);
+        abortRebuild(rb);
+    }
+
+    if (field.debug)
+        LOGSTDERR(DEBUG, PQresStatus(PQresultStatus(writeResult)), "%s", sql);
+
+    PQclear(writeResult);
+    free((void *) sql);
+}
+
+// refuse tables a rebuild would break: the swap gives the table a new
+// oid, which foreign keys pointing at it, views and inheritance follow
+// to the original, and row level security policies aren't carried over
+static void checkRebuildable(Rebuild* rb)
+{
+    PGresult* readResult = NULL;
+
+    const char checkSql[] =
+    "select (select count(*) from pg_constraint"
+    "         where confrelid = '%1$s'::regclass and conrelid <> confrelid and contype = 'f'),"
+    "       (select count(*) from pg_depend d join pg_rewrite r on r.oid = d.objid"
+    "         where d.classid = 'pg_rewrite'::regclass and d.refobjid = '%1$s'::regclass"
+    "           and r.ev_class <> d.refobjid),"
+    "       (select count(*) from pg_inherits"
+    "         where inhparent = '%1$s'::regclass or inhrelid = '%1$s'::regclass),"
+    "       (select count(*) from pg_policy where polrelid = '%1$s'::regclass);";
+
+    if (PQserverVersion(rb->readCxn) < 120000)
+    {
+        LOGSTDERR(ERROR, "REBUILD_UNSUPPORTED",
+            "--mode=rebuild needs PostgreSQL 12 or later; the server is %d",
+            PQserverVersion(rb->readCxn));
+        clean_exit(EXIT_FAILURE);
+    }
+
+    readResult = pq_vaquery(rb->readCxn, checkSql, rb->fullTableName);
+
+    if (PQresultStatus(readResult) != PGRES_TUPLES_OK)
+    {
+        LOGSTDERR(ERROR, PQerrorMessage(rb->readCxn),
+            "Rebuild check query failed: %s", checkSql);
+        clean_exit(EXIT_FAILURE);
+    }
+
+    if (atoi(PQgetvalue(readResult, 0, 0)) > 0 || atoi(PQgetvalue(readResult, 0, 1)) > 0 ||
+        atoi(PQgetvalue(readResult, 0, 2)) > 0 || atoi(PQgetvalue(readResult, 0, 3)) > 0)
+    {
+        LOGSTDERR(ERROR, "REBUILD_UNSUPPORTED",
+            "%s has %s foreign keys pointing at it, %s views, %s inheritance links and %s policies;"
+            " --mode=rebuild can't swap it",
+            rb->fullTableName, PQgetvalue(readResult, 0, 0), PQgetvalue(readResult, 0, 1),
+            PQgetvalue(readResult, 0, 2), PQgetvalue(readResult, 0, 3));
+        clean_exit(EXIT_FAILURE);
+    }
+
+    PQclear(readResult);
+}
+
+// list the columns copied into the shadow table, every one but generated
+// columns, which are computed again, and flag the character-based ones
+static void getCopiedCols(Rebuild* rb, const Vector* cbColNames)
+{
+    PGresult* readResult = NULL;
+    char* tmp = NULL;
+    int row = 0;
+    int i = 0;
+
+    const char colsSql[] =
+    "select attname"
+    "  from pg_attribute"
+    " where attrelid = '%s'::regclass"
+    "   and attnum > 0"
+    "   and not attisdropped"
+    "   and attgenerated = ''"
+    " order by attnum;";
+
+    readResult = pq_vaquery(rb->readCxn, colsSql, rb->fullTableName);
+
+    if (PQresultStatus(readResult) != PGRES_TUPLES_OK)
+    {
+        LOGSTDERR(ERROR, PQerrorMessage(rb->readCxn),
+            "Columns query failed: %s", colsSql);
+        clean_exit(EXIT_FAILURE);
+    }
+
+    rb->colCount = PQntuples(readResult);
+    rb->isCBCol = calloc(rb->colCount, sizeof(bool));
+    rb->colList = calloc(sizeof(char), 1);
+
+    for (row = 0; row < rb->colCount; row++)
+    {
+        const char* col = PQgetvalue(readResult, row, 0);
+
+        tmp = rb->colList;
+        rb->colList = concat(tmp, (row > 0 ? ", " : ""), col, (char*) NULL);
+        free((void *) tmp);
+
+        for (i = 0; i < cbColNames->size; i++)
+            if (strcmp(col, (const char*) cbColNames->data[i]) == 0)
+                rb->isCBCol[row] = true;
+    }
+
+    PQclear(readResult);
+}
+
+// start a binary COPY into the shadow table on the write connection, and
+// start its data in *buf with the file header
+static void openCopyIn(Rebuild* rb, char** buf, size_t* len, size_t* cap)
+{
+    PGresult* writeResult = NULL;
+
+    writeResult = pq_vaquery(rb->writeCxn, "copy %s (%s) from stdin with (format binary);",
+                             rb->shadowTable, rb->colList);
+
+    if (PQresultStatus(writeResult) != PGRES_COPY_IN)
+    {
+        LOGSTDERR(ERROR, PQerrorMessage(rb->writeCxn),
+            "Copy into %s failed", rb->shadowTable);
+        PQclear(writeResult);
+        abortRebuild(rb);
+    }
+
+    PQclear(writeResult);
+
+    // signature, flags and header extension length
+    *len = 0;
+    appendBytes(buf, len, cap, COPY_BINARY_SIGNATURE, COPY_BINARY_SIGNATURE_LEN);
+    appendCopyInt(buf, len, cap, 4, 0);
+    appendCopyInt(buf, len, cap, 4, 0);
+}
+
+// send the trailer of a COPY opened with openCopyIn(), and check how it ended
+static void closeCopyIn(Rebuild* rb, char** buf, size_t* len, size_t* cap)
+{
+    PGresult* writeResult = NULL;
+    bool ok = true;
+
+    appendCopyInt(buf, len, cap, 2, -1);
+
+    if (PQputCopyData(rb->writeCxn, *buf, *len) != 1 ||
+        PQputCopyEnd(rb->writeCxn, NULL) != 1)
+        ok = false;
+
+    *len = 0;
+
+    while ((writeResult = PQgetResult(rb->writeCxn)) != NULL)
+    {
+        if (PQresultStatus(writeResult) != PGRES_COMMAND_OK)
+            ok = false;
+
+        PQclear(writeResult);
+    }
+
+    if (!ok)
+    {
+        LOGSTDERR(ERROR, PQerrorMessage(rb->writeCxn),
+            "Copy into %s failed", rb->shadowTable);
+        abortRebuild(rb);
+    }
+}
+
+// detect, convert and log the character-based values of a row of the
+// read query, given as its fields' bytes and lengths, -1 for NULL, and
+// append the row to buf as a binary COPY row of the copied columns.  the
+// other columns are passed through in their binary form as they are.
+// returns true if a value changed
+static bool appendRebuiltRow(Rebuild* rb, const char** values, const long* lengths,
+                             char** buf, size_t* len, size_t* cap)
+{
+    Vector cbColValues;
+    Vector newCBColValues;
+    char* ukValues = NULL;
+    bool changed = false;
+    int col = 0;
+    int k = 0;
+
+    // first field is the unique key values, then the copied columns
+    ukValues = (lengths[0] < 0 ? strdup("NULL") : strndup(values[0], lengths[0]));
+
+    vector_init(&cbColValues, "PGColResult*", 0);
+    vector_init(&newCBColValues, "PGColResult*", 0);
+
+    for (col = 0; col < rb->colCount; col++)
+    {
+        if (rb->isCBCol[col])
+            vector_append(&cbColValues,
+                (void *) newColResultFromField(rb->fields, col + 1,
+                            (lengths[col + 1] < 0 ? "" : values[col + 1]),
+                            (lengths[col + 1] < 0 ? 0 : lengths[col + 1]),
+                            (lengths[col + 1] < 0)));
+    }
+
+    if (cbColValues.size > 0)
+        convertCBColValues(rb->uniqueKeyCols, ukValues, &cbColValues, &newCBColValues);
+
+    appendCopyInt(buf, len, cap, 2, rb->colCount);
+
+    for (col = 0; col < rb->colCount; col++)
+    {
+        if (rb->isCBCol[col])
+        {
+            const PGColResult* colResult = newCBColValues.data[k];
+
+            if (!colResultValueEquals(cbColValues.data[k], colResult))
+                changed = true;
+
+            if (colResult->isnull)
+                appendCopyField(buf, len, cap, NULL, 0);
+            else
+                appendCopyField(buf, len, cap, colResult->value,
+                                colResultWriteLength(colResult));
+
+            k++;
+        }
+        else
+        {
+            appendCopyField(buf, len, cap,
+                            (lengths[col + 1] < 0 ? NULL : values[col + 1]),
+                            lengths[col + 1]);
+        }
+    }
+
+    vector_free(&cbColValues);
+    vector_free(&newCBColValues);
+    free((void *) ukValues);
+
+    return changed;
+}
+
+// apply the changes the log trigger caught since the copy or the last
+// pass: the logged keys are moved to a session-local table, their rows
+// deleted from the shadow table, and read from the table, converted and
+// copied into the shadow table again, all in one transaction unless the
+// caller has one open.  a row changed again meanwhile is logged again,
+// and replayed by the next pass.  returns the number of keys replayed
+static unsigned long replayLog(Rebuild* rb, bool inTransaction)
+{
+    PGresult* writeResult = NULL;
+    PGresult* readResult = NULL;
+    unsigned long keys = 0;
+    char* where = NULL;
+    char* buf = NULL;
+    size_t len = 0;
+    size_t cap = 0;
+    int fieldCount = PQnfields(rb->fields);
+    int row = 0;
+    int col = 0;
+
+    const char** values = calloc(fieldCount, sizeof(char*));
+    long* lengths = calloc(fieldCount, sizeof(long));
+
+    if (!inTransaction)
+        rebuildExec(rb, "begin;");
+
+    rebuildExec(rb, "create temp table " REBUILD_REPLAY_TABLE " on commit drop"
+                    " as select * from %s with no data;", rb->logTable);
+
+    writeResult = pq_vaquery(rb->writeCxn,
+        "with logged as (delete from %s returning *)"
+        " insert into " REBUILD_REPLAY_TABLE " select distinct * from logged;",
+        rb->logTable);
+
+    if (PQresultStatus(writeResult) != PGRES_COMMAND_OK)
+    {
+        LOGSTDERR(ERROR, PQerrorMessage(rb->writeCxn),
+            "Cannot read the change log %s", rb->logTable);
+        PQclear(writeResult);
+        abortRebuild(rb);
+    }
+
+    keys = strtoul(PQcmdTuples(writeResult), NULL, 10);
+    PQclear(writeResult);
+
+    if (keys > 0)
+    {
+        rebuildExec(rb, "delete from %s where (%s) in (select %s from " REBUILD_REPLAY_TABLE ");",
+                    rb->shadowTable, rb->uniqueKeyCols, rb->uniqueKeyCols);
+
+        where = concat(" where (", rb->uniqueKeyCols, ") in (select ", rb->uniqueKeyCols,
+                       " from " REBUILD_REPLAY_TABLE ")", (char*) NULL);
+
+        // deleted rows aren't there to read, so they stay deleted
+        readResult = pq_vaqueryparams(rb->writeCxn, 0, NULL, BINARY_RESULTS,
+                                      rb->readQuery, rb->fullTableName, where);
+
+        if (PQresultStatus(readResult) != PGRES_TUPLES_OK)
+        {
+            LOGSTDERR(ERROR, PQerrorMessage(rb->writeCxn),
+                "Cannot read the changed rows of %s", rb->fullTableName);
+            PQclear(readResult);
+            abortRebuild(rb);
+        }
+
+        openCopyIn(rb, &buf, &len, &cap);
+
+        for (row = 0; row < PQntuples(readResult); row++)
+        {
+            for (col = 0; col < fieldCount; col++)
+            {
+                values[col]  = PQgetvalue(readResult, row, col);
+                lengths[col] = (PQgetisnull(readResult, row, col) ? -1 :
+                                PQgetlength(readResult, row, col));
+            }
+
+            appendRebuiltRow(rb, values, lengths, &buf, &len, &cap);
+
+            if (PQputCopyData(rb->writeCxn, buf, len) != 1)
+            {
+                LOGSTDERR(ERROR, PQerrorMessage(rb->writeCxn),
+                    "Copy into %s failed", rb->shadowTable);
+                abortRebuild(rb);
+            }
+
+            len = 0;
+        }
+
+        closeCopyIn(rb, &buf, &len, &cap);
+
+        PQclear(readResult);
+        free((void *) where);
+        free((void *) buf);
+
+        rb->rowsReplayed += keys;
+    }
+
+    if (!inTransaction)
+        rebuildExec(rb, "commit;");
+
+    LOGSTDERR(INFO, PQresStatus(PGRES_COMMAND_OK),
+        "Replayed %lu logged changes to %s", keys, rb->fullTableName);
+
+    free((void *) values);
+    free((void *) lengths);
+
+    return keys;
+}
+
+// get ready to rebuild a table: check it can be swapped, list its columns
+// and describe the read query, then create the log table and the trigger
+// that fills it, which are committed before the copy starts, so every
+// change the copy doesn't see is logged
+void rebuildOpen(Rebuild* rb, PGconn* readCxn, PGconn* writeCxn,
+                 const char* schema,
+                 const char* table,
+                 const char* fullTableName,
+                 const char* uniqueKeyCols,
+                 const char* uniqueKeyDataTypes,
+                 const Vector* cbColNames)
+{
+    Vector keyCols;
+    char* ukExpr = NULL;
+    char* oldKeys = NULL;
+    char* newKeys = NULL;
+    char* tmp = NULL;
+    int i = 0;
+
+    memset(rb, 0, sizeof(Rebuild));
+
+    rb->readCxn       = readCxn;
+    rb->writeCxn      = writeCxn;
+    rb->schema        = schema;
+    rb->table         = table;
+    rb->fullTableName = fullTableName;
+    rb->uniqueKeyCols = uniqueKeyCols;
+
+    rb->shadowName  = concat(table, REBUILD_SHADOW_SUFFIX, (char*) NULL);
+    rb->shadowTable = concat(schema, ".", table, REBUILD_SHADOW_SUFFIX, (char*) NULL);
+    rb->logTable    = concat(schema, ".", table, REBUILD_LOG_SUFFIX, (char*) NULL);
+    rb->logFunction = concat(schema, ".", table, REBUILD_LOG_FUNCTION_SUFFIX, (char*) NULL);
+
+    checkRebuildable(rb);
+    getCopiedCols(rb, cbColNames);
+
+    // the key values as cast literals for the conversion log, then every
+    // copied column
+    ukExpr = constructUkValuesExpr(uniqueKeyCols, uniqueKeyDataTypes);
+    rb->readQuery = concat("select ", ukExpr, " as uk_values, ", rb->colList,
+                           " from %s%s", (char*) NULL);
+    free((void *) ukExpr);
+
+    // COPY doesn't describe the columns it sends
+    rb->fields = pq_vaqueryparams(readCxn, 0, NULL, BINARY_RESULTS,
+                                  rb->readQuery, fullTableName, " where false");
+
+    if (PQresultStatus(rb->fields) != PGRES_TUPLES_OK)
+    {
+        LOGSTDERR(ERROR, PQerrorMessage(readCxn),
+            "Describe rebuild columns query failed: %s", rb->readQuery);
+        clean_exit(EXIT_FAILURE);
+    }
+
+    // "OLD.<uk col1>, ..." and "NEW.<uk col1>, ..."
+    splitString(&keyCols, uniqueKeyCols, ", ");
+
+    oldKeys = calloc(sizeof(char), 1);
+    newKeys = calloc(sizeof(char), 1);
+
+    for (i = 0; i < keyCols.size; i++)
+    {
+        tmp = oldKeys;
+        oldKeys = concat(tmp, (i > 0 ? ", " : ""), "OLD.", (const char*) keyCols.data[i], (char*) NULL);
+        free((void *) tmp);
+
+        tmp = newKeys;
+        newKeys = concat(tmp, (i > 0 ? ", " : ""), "NEW.", (const char*) keyCols.data[i], (char*) NULL);
+        free((void *) tmp);
+    }
+
+    vector_free(&keyCols);
+
+    rebuildExec(rb, "create table %s as select %s from %s with no data;",
+                rb->logTable, uniqueKeyCols, fullTableName);
+
+    rebuildExec(rb,
+        "create function %s() returns trigger language plpgsql as $transcoder$"
+        " begin"
+        "   if tg_op in ('UPDATE', 'DELETE') then insert into %s values (%s); end if;"
+        "   if tg_op in ('INSERT', 'UPDATE') then insert into %s values (%s); end if;"
+        "   return null;"
+        " end $transcoder$;",
+        rb->logFunction, rb->logTable, oldKeys, rb->logTable, newKeys);
+
+    rebuildExec(rb, "create trigger " REBUILD_TRIGGER
+                    " after insert or update or delete on %s"
+                    " for each row execute procedure %s();",
+                fullTableName, rb->logFunction);
+
+    free((void *) oldKeys);
+    free((void *) newKeys);
+
+    LOGSTDERR(INFO, PQresStatus(PGRES_COMMAND_OK),
+        "Logging changes to %s in %s while it is rebuilt", fullTableName, rb->logTable);
+}
+
+// create the shadow table like the table, without its indexes, and stream
+// every row of the table into it: out with a binary COPY TO STDOUT on the
+// read connection, each row's character-based values converted on the way,
+// and in with a binary COPY FROM STDIN on the write connection.  the table
+// is created and filled in one transaction, which with wal_level=minimal
+// also skips writing the rows to the WAL
+void rebuildCopy(Rebuild* rb)
+{
+    PGresult* readResult = NULL;
+    char* copy = NULL;
+    char* in = NULL;
+    int inLen = 0;
+    char* buf = NULL;
+    size_t len = 0;
+    size_t cap = 0;
+    bool headerRead = false;
+    int fieldCount = PQnfields(rb->fields);
+    int parsed = 0;
+
+    const char** values = calloc(fieldCount, sizeof(char*));
+    long* lengths = calloc(fieldCount, sizeof(long));
+
+    rebuildExec(rb, "begin;");
+
+    rebuildExec(rb, "create table %s (like %s including all excluding indexes);",
+                rb->shadowTable, rb->fullTableName);
+
+    rb->shadowCreated = true;
+
+    openCopyIn(rb, &buf, &len, &cap);
+
+    copy = concat("copy (", rb->readQuery, ") to stdout with (format binary);", (char*) NULL);
+
+    readResult = pq_vaquery(rb->readCxn, copy, rb->fullTableName, "");
+
+    if (PQresultStatus(readResult) != PGRES_COPY_OUT)
+    {
+        LOGSTDERR(ERROR, PQerrorMessage(rb->readCxn),
+            "Copy to stdout failed: %s", copy);
+        PQclear(readResult);
+        abortRebuild(rb);
+    }
+
+    PQclear(readResult);
+
+    LOGSTDERR(INFO, PQresStatus(PGRES_COPY_OUT),
+        "Copying %s into %s", rb->fullTableName, rb->shadowTable);
+
+    // one call returns one row
+    while ((inLen = PQgetCopyData(rb->readCxn, &in, 0)) >= 0)
+    {
+        parsed = parseCopyRow(in, inLen, &headerRead, fieldCount, values, lengths);
+
+        if (parsed < 0)
+        {
+            LOGSTDERR(ERROR, "BAD_COPY_DATA",
+                "Copy to stdout sent a malformed row: %s", copy);
+            abortRebuild(rb);
+        }
+
+        if (parsed > 0)
+        {
+            if (appendRebuiltRow(rb, values, lengths, &buf, &len, &cap))
+                rb->rowsChanged++;
+
+            if (PQputCopyData(rb->writeCxn, buf, len) != 1)
+            {
+                LOGSTDERR(ERROR, PQerrorMessage(rb->writeCxn),
+                    "Copy into %s failed", rb->shadowTable);
+                abortRebuild(rb);
+            }
+
+            len = 0;
+            rb->rowsCopied++;
+
+            if (rb->rowsCopied % REBUILD_PROGRESS_ROWS == 0)
+                LOGSTDERR(INFO, PQresStatus(PGRES_COPY_OUT),
+                    "Copied %lu rows of %s, %lu converted",
+                    rb->rowsCopied, rb->fullTableName, rb->rowsChanged);
+        }
+
+        PQfreemem((void *) in);
+    }
+
+    // copy out is done, check how it ended
+    if (inLen == -2)
+    {
+        LOGSTDERR(ERROR, PQerrorMessage(rb->readCxn),
+            "Copy to stdout failed: %s", copy);
+        abortRebuild(rb);
+    }
+
+    while ((readResult = PQgetResult(rb->readCxn)) != NULL)
+    {
+        if (PQresultStatus(readResult) != PGRES_COMMAND_OK)
+        {
+            LOGSTDERR(ERROR, PQerrorMessage(rb->readCxn),
+                "Copy to stdout failed: %s", copy);
+            PQclear(readResult);
+            abortRebuild(rb);
+        }
+
+        PQclear(readResult);
+    }
+
+    closeCopyIn(rb, &buf, &len, &cap);
+
+    rebuildExec(rb, "commit;");
+
+    LOGSTDERR(INFO, PQresStatus(PGRES_COMMAND_OK),
+        "Copied %lu rows of %s into %s, %lu converted",
+        rb->rowsCopied, rb->fullTableName, rb->shadowTable, rb->rowsChanged);
+
+    free((void *) copy);
+    free((void *) buf);
+    free((void *) values);
+    free((void *) lengths);
+}
+
+// give the shadow table the table's indexes, constraints, owner and
+// grants, catch up on the changes logged meanwhile, then lock both
+// tables, replay the last of the log, add the foreign keys and triggers
+// and swap the names.  the original is kept as <table>_transcoder_old
+void rebuildFinish(Rebuild* rb)
+{
+    PGresult* readResult = NULL;
+    PGresult* writeResult = NULL;
+    Vector swapDdl;
+    Vector validate;
+    Vector retire;
+    Vector promote;
+    int step = 0;
+    bool locked = false;
+    int attempt = 0;
+    int pass = 0;
+    int row = 0;
+    int i = 0;
+
+    vector_init(&swapDdl, "char*", 0);
+    vector_init(&validate, "char*", 0);
+    vector_init(&retire, "char*", 0);
+    vector_init(&promote, "char*", 0);
+
+    // an empty search_path gets every name in the definitions qualified
+    readResult = pq_query(rb->readCxn, "begin; set local search_path to '';");
+    PQclear(readResult);
+
+    readResult = pq_vaquery(rb->readCxn, buildShadowSql,
+                            rb->schema, rb->table, rb->shadowName, rb->fullTableName);
+
+    if (PQresultStatus(readResult) != PGRES_TUPLES_OK)
+    {
+        LOGSTDERR(ERROR, PQerrorMessage(rb->readCxn),
+            "Cannot get the definitions of %s", rb->fullTableName);
+        PQclear(readResult);
+        abortRebuild(rb);
+    }
+
+    // building the indexes after the copy is much faster than keeping
+    // them up to date while it runs.  foreign keys and triggers wait for
+    // the swap, so the catch-up passes don't fire them
+    for (row = 0; row < PQntuples(readResult); row++)
+    {
+        step = atoi(PQgetvalue(readResult, row, 0));
+
+        if (!PQgetisnull(readResult, row, 2))
+            vector_append(&validate, (void *) strdup(PQgetvalue(readResult, row, 2)));
+
+        if (step == 3 || step == 4)
+        {
+            vector_append(&swapDdl, (void *) strdup(PQgetvalue(readResult, row, 1)));
+            continue;
+        }
+
+        LOGSTDERR(INFO, PQresStatus(PGRES_COMMAND_OK),
+            "%s", PQgetvalue(readResult, row, 1));
+
+        rebuildExec(rb, "%s;", PQgetvalue(readResult, row, 1));
+    }
+
+    PQclear(readResult);
+
+    readResult = pq_vaquery(rb->readCxn, swapSql,
+                            rb->schema, rb->table, rb->shadowName, rb->fullTableName);
+
+    if (PQresultStatus(readResult) != PGRES_TUPLES_OK)
+    {
+        LOGSTDERR(ERROR, PQerrorMessage(rb->readCxn),
+            "Cannot get the swap statements for %s", rb->fullTableName);
+        PQclear(readResult);
+        abortRebuild(rb);
+    }
+
+    for (row = 0; row < PQntuples(readResult); row++)
+    {
+        if (!PQgetisnull(readResult, row, 0))
+            vector_append(&retire, (void *) strdup(PQgetvalue(readResult, row, 0)));
+
+        if (!PQgetisnull(readResult, row, 1))
+            vector_append(&promote, (void *) strdup(PQgetvalue(readResult, row, 1)));
+    }
+
+    PQclear(readResult);
+
+    readResult = pq_query(rb->readCxn, "commit;");
+    PQclear(readResult);
+
+    // catch up while the application runs, until what's left is small
+    // enough to replay with the tables locked
+    for (pass = 0; pass < REBUILD_CATCHUP_PASSES; pass++)
+        if (replayLog(rb, false) <= REBUILD_SWAP_BACKLOG)
+            break;
+
+    // don't queue the application behind a long running transaction
+    // while waiting for the lock; give up and catch up instead
+    for (attempt = 1; !locked; attempt++)
+    {
+        rebuildExec(rb, "begin;");
+        rebuildExec(rb, "set local lock_timeout = '" REBUILD_LOCK_TIMEOUT "';");
+
+        writeResult = pq_vaquery(rb->writeCxn, "lock table %s, %s in access exclusive mode;",
+                                 rb->fullTableName, rb->shadowTable);
+        locked = (PQresultStatus(writeResult) == PGRES_COMMAND_OK);
+
+        if (!locked)
+        {
+            LOGSTDERR(WARNING, PQerrorMessage(rb->writeCxn),
+                "Cannot lock %s for the swap, attempt %d of %d",
+                rb->fullTableName, attempt, REBUILD_LOCK_ATTEMPTS);
+
+            rebuildExec(rb, "rollback;");
+
+            if (attempt >= REBUILD_LOCK_ATTEMPTS)
+            {
+                PQclear(writeResult);
+                abortRebuild(rb);
+            }
+
+            replayLog(rb, false);
+        }
+
+        PQclear(writeResult);
+    }
+
+    // nothing can change the table now, so this is the last of the log
+    replayLog(rb, true);
+
+    for (i = 0; i < swapDdl.size; i++)
+    {
+        LOGSTDERR(INFO, PQresStatus(PGRES_COMMAND_OK),
+            "%s", (const char*) swapDdl.data[i]);
+
+        rebuildExec(rb, "%s;", (const char*) swapDdl.data[i]);
+    }
+
+    for (i = 0; i < retire.size; i++)
+        rebuildExec(rb, "%s;", (const char*) retire.data[i]);
+
+    rebuildExec(rb, "drop trigger " REBUILD_TRIGGER " on %s;", rb->fullTableName);
+    rebuildExec(rb, "alter table %s rename to %s" REBUILD_OLD_SUFFIX ";",
+                rb->fullTableName, rb->table);
+    rebuildExec(rb, "alter table %s rename to %s;", rb->shadowTable, rb->table);
+
+    for (i = 0; i < promote.size; i++)
+        rebuildExec(rb, "%s;", (const char*) promote.data[i]);
+
+    rebuildExec(rb, "drop table %s;", rb->logTable);
+    rebuildExec(rb, "drop function %s();", rb->logFunction);
+    rebuildExec(rb, "commit;");
+
+    // the shadow table is the table now
+    rb->shadowCreated = false;
+
+    LOGSTDERR(INFO, PQresStatus(PGRES_COMMAND_OK),
+        "Swapped the rebuilt %s in; the original is %s" REBUILD_OLD_SUFFIX,
+        rb->fullTableName, rb->fullTableName);
+
+    // check the foreign keys added NOT VALID without blocking writes.  the
+    // swap can't be undone now, so a failure only leaves one unvalidated
+    for (i = 0; i < validate.size; i++)
+    {
+        writeResult = pq_vaquery(rb->writeCxn, "%s;", (const char*) validate.data[i]);
+
+        if (PQresultStatus(writeResult) != PGRES_COMMAND_OK)
+            LOGSTDERR(WARNING, PQerrorMessage(rb->writeCxn),
+                "Foreign key left not valid: %s", (const char*) validate.data[i]);
+
+        PQclear(writeResult);
+    }
+
+    vector_free(&swapDdl);
+    vector_free(&validate);
+    vector_free(&retire);
+    vector_free(&promote);
+}
+
+void rebuildClose(Rebuild* rb)
+{
+    if (rb->fields)
+        PQclear(rb->fields);
+
+    free((void *) rb->shadowName);
+    free((void *) rb->shadowTable);
+    free((void *) rb->logTable);
+    free((void *) rb->logFunction);
+    free((void *) rb->colList);
+    free((void *) rb->isCBCol);
+    free((void *) rb->readQuery);
+
+    rb->fields = NULL;
+}
@@ -0,0 +1,84 @@
+/*
+ * rebuild.h
+ *
+ * Table rebuilds that stream every row through the transcoder into a
+ * shadow table with COPY and swap it in for the original
+ *
+ * Copyright © 2015, AWeber Communications.
+ * All rights reserved.
+ */
+
+#ifndef _REBUILD_H_
+#define _REBUILD_H_
+
+#include <libpq-fe.h>
+#include <stdbool.h>
+
+#include "vector.h"
+
+// suffixes of the tables and function a rebuild creates next to the
+// table, and of the constraint and index names the shadow table uses
+// until the swap
+#define REBUILD_SHADOW_SUFFIX       "_transcoder"
+#define REBUILD_OLD_SUFFIX          "_transcoder_old"
+#define REBUILD_LOG_SUFFIX          "_transcoder_log"
+#define REBUILD_LOG_FUNCTION_SUFFIX "_transcoder_log_fn"
+
+// trigger logging the keys of rows changed while the table is rebuilt
+#define REBUILD_TRIGGER             "transcoder_rebuild_log"
+
+// session-local table holding the logged keys a catch-up pass replays
+#define REBUILD_REPLAY_TABLE        "transcoder_replay"
+
+// logged keys a catch-up pass may leave for the swap, which replays them
+// with the table locked, and catch-up passes to try before locking anyway
+#define REBUILD_SWAP_BACKLOG        1000
+#define REBUILD_CATCHUP_PASSES      10
+
+// how long the swap waits for its lock, and how often it tries, catching
+// up between tries, so it doesn't queue the application behind a long
+// running transaction
+#define REBUILD_LOCK_TIMEOUT        "2s"
+#define REBUILD_LOCK_ATTEMPTS       10
+
+// rows copied between progress messages
+#define REBUILD_PROGRESS_ROWS       100000
+
+typedef struct
+{
+    PGconn*         readCxn;        // streams the table out
+    PGconn*         writeCxn;       // streams the shadow table in, and runs the DDL
+    const char*     schema;         // schema of the table
+    const char*     table;          // table name
+    const char*     fullTableName;  // schema-qualified table name
+    const char*     uniqueKeyCols;  // shortest unique key column(s), comma separated
+    char*           shadowName;     // <table>_transcoder
+    char*           shadowTable;    // schema-qualified shadow table name
+    char*           logTable;       // schema-qualified <table>_transcoder_log
+    char*           logFunction;    // schema-qualified <table>_transcoder_log_fn
+    char*           colList;        // copied columns, comma separated: all but generated ones
+    int             colCount;       // columns in colList
+    bool*           isCBCol;        // for each copied column, whether it's transcoded
+    char*           readQuery;      // "select <uk values expr>, <colList> from %s%s", see rebuildOpen()
+    PGresult*       fields;         // descriptions of readQuery's columns
+    bool            shadowCreated;  // the shadow table exists, and is dropped if the rebuild fails
+    unsigned long   rowsCopied;     // rows streamed into the shadow table
+    unsigned long   rowsChanged;    // rows copied with a converted value
+    unsigned long   rowsReplayed;   // logged keys replayed by catch-up passes and the swap
+} Rebuild;
+
+void rebuildOpen(Rebuild* rb, PGconn* readCxn, PGconn* writeCxn,
+                 const char* schema,
+                 const char* table,
+                 const char* fullTableName,
+                 const char* uniqueKeyCols,
+                 const char* uniqueKeyDataTypes,
+                 const Vector* cbColNames);
+
+void rebuildCopy(Rebuild* rb);
+
+void rebuildFinish(Rebuild* rb);
+
+void rebuildClose(Rebuild* rb);
+
+#endif // #ifndef _REBUILD_H_
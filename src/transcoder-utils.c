@@ -36,6 +36,24 @@ MODIFICATIONS.
 * optional:
 *
 * --report - report detected character set encoding, but do not translate
+* --batch-size - read this many rows per round trip
+* --scan - how to walk the table: keyset (default), cursor, copy or ctid
+* --trust-utf8 - keep values that are valid UTF-8 as they are, without detecting their encoding
+* --non-ascii-only - only read rows with a non-ASCII character-based column value
+* --skip-ascii-columns - only read the character-based column values that are non-ASCII
+* --write-batch-size - write this many converted rows per update statement, or per staging flush
+* --write - how to write converted rows: update (default) or copy
+* --commit-every - commit writes after this many rows instead of every statement or flush
+* --commit-interval - commit writes after this many milliseconds instead of every statement or flush
+* --async-commit - turn off synchronous_commit for the write connection
+* --pipeline-depth - send this many single row updates per libpq pipeline; 0 to not pipeline
+* --optimistic - only write rows not changed since they were read, and re-read the ones that were
+* --conflict-retries - re-read rows changed since they were read this many times under --optimistic
+* --lock-timeout - give up on a row write after waiting this many milliseconds for a lock, and retry it later
+* --statement-timeout - give up on a write statement after this many milliseconds, and retry its rows later
+* --skip-locked - read rows with for update skip locked, and retry the ones locked later
+* --retry-backoff - milliseconds to wait before the second round of retries, doubled for each round after
+* --mode - update (default) converts rows in place; rebuild copies the table into a shadow table and swaps it in
 *
 * help:
 *
@@ -46,6 +64,7 @@ MODIFICATIONS.
 // pick up vasprintf
 #define _GNU_SOURCE
 #include <stdio.h>
+#include <stdint.h>
 #include <string.h>
 #include <signal.h>
 
@@ -58,6 +77,12 @@ struct option long_options[] =
     {"help",    no_argument, &field.help,   1},
     {"debug",   no_argument, &field.debug,  1},
     {"force",   no_argument, &field.force,  1},
+    {"non-ascii-only", no_argument, &field.nonAsciiOnly, 1},
+    {"skip-ascii-columns", no_argument, &field.skipAsciiColumns, 1},
+    {"async-commit", no_argument, &field.asyncCommit, 1},
+    {"optimistic", no_argument, &field.optimistic, 1},
+    {"skip-locked", no_argument, &field.skipLocked, 1},
+    {"trust-utf8", no_argument, &field.trustUtf8, 1},
     {"dsn",     required_argument, 0, 'd'},
     {"schema",  required_argument, 0, 's'},
     {"table",   required_argument, 0, 't'},
@@ -65,12 +90,30 @@ struct option long_options[] =
     {"restart", required_argument, 0, 'r'},
     {"limit",   required_argument, 0, 'l'},
     {"hint",    required_argument, 0, 'e'},
+    {"batch-size", required_argument, 0, 'b'},
+    {"scan",    required_argument, 0, 'c'},
+    {"write-batch-size", required_argument, 0, 'w'},
+    {"write",   required_argument, 0, 'W'},
+    {"commit-every", required_argument, 0, 'C'},
+    {"commit-interval", required_argument, 0, 'I'},
+    {"pipeline-depth", required_argument, 0, 'P'},
+    {"conflict-retries", required_argument, 0, 'R'},
+    {"lock-timeout", required_argument, 0, 'L'},
+    {"statement-timeout", required_argument, 0, 'T'},
+    {"retry-backoff", required_argument, 0, 'B'},
+    {"mode",    required_argument, 0, 'M'},
     {0, 0, 0, 0}
 };
 
 static char usage[] = "Usage: transcoder --dsn=<dsn spec> --schema=<schema name> --table=<table name> \\ \n"
                       "                  --one-row=<unique key value> --restart=<unique key value> --limit=<integer> \\\n"
-                      "                  --hint=<encoding> --force --report --debug --help\n"
+                      "                  --hint=<encoding> --batch-size=<integer> --scan=<keyset|cursor|copy|ctid> \\\n"
+                      "                  --write-batch-size=<integer> --write=<update|copy> --commit-every=<integer> \\\n"
+                      "                  --commit-interval=<milliseconds> --async-commit --pipeline-depth=<integer> \\\n"
+                      "                  --optimistic --conflict-retries=<integer> --lock-timeout=<milliseconds> \\\n"
+                      "                  --statement-timeout=<milliseconds> --skip-locked --retry-backoff=<milliseconds> \\\n"
+                      "                  --mode=<update|rebuild> \\\n"
+                      "                  --trust-utf8 --non-ascii-only --skip-ascii-columns --force --report --debug --help\n"
                       "\n"
                       "                  --dsn: dsn spec with the form:\n"
                       "                         'host=<host> port=<port> dbname=<db> user=<dblogin> password=<dbpwd>'\n"
@@ -85,6 +128,69 @@ static char usage[] = "Usage: transcoder --dsn=<dsn spec> --schema=<schema name>
                       "                  --restart: restart at the specified unique key.  Optional. See --one-row for syntax\n"
                       "                  --limit:   limit the number of rows processed.  Optional.\n"
                       "                  --hint:    declared encoding from alternate source, like html header or xml declaration.\n"
+                      "                  --batch-size: read this many rows, ordered by the shortest unique key, per round\n"
+                      "                             trip to the database instead of one row at a time.  Optional.\n"
+                      "                  --scan:    keyset (default) walks the table one key, or one --batch-size batch,\n"
+                      "                             at a time.  cursor streams the whole table, in unique key order, through\n"
+                      "                             a server-side cursor, fetching --batch-size rows (default 1000) per FETCH.\n"
+                      "                             copy streams the whole table with COPY ... TO STDOUT, the cheapest way\n"
+                      "                             to read every row, e.g. for --report runs.\n"
+                      "                             ctid walks the heap in physical order, --batch-size blocks (default 128)\n"
+                      "                             at a time, and identifies rows by ctid and xmin, so tables without a\n"
+                      "                             unique index can be transcoded.  --restart takes a row's ctid and xmin.\n"
+                      "                             Rows changed before they're written are re-read by the unique key, if\n"
+                      "                             the table has one, and fail the run otherwise.\n"
+                      "                             Optional.\n"
+                      "                  --write-batch-size: write this many converted rows per update statement,\n"
+                      "                             and so per transaction, instead of one.  With --write=copy, the number\n"
+                      "                             of rows per staging flush (default 10000).  Optional.\n"
+                      "                  --write:   update (default) writes rows with update statements.  copy streams them\n"
+                      "                             into a temporary staging table with COPY ... FROM STDIN and applies\n"
+                      "                             each flush with one UPDATE ... FROM the staging table.  Optional.\n"
+                      "                  --commit-every: commit writes after this many rows instead of after every update\n"
+                      "                             statement, or every --write=copy flush.  Each statement or flush has its\n"
+                      "                             own savepoint, so a failed one doesn't roll back the rest.  Optional.\n"
+                      "                  --commit-interval: commit writes after this many milliseconds, like --commit-every.\n"
+                      "                             With both, whichever comes first.  Optional.\n"
+                      "                  --async-commit: turn off synchronous_commit for the write connection, so commits\n"
+                      "                             don't wait for a WAL flush.  A crash can lose the last commits.  Optional.\n"
+                      "                  --pipeline-depth: on PostgreSQL 14 and later, send this many single row updates\n"
+                      "                             (default 100) before reading their results, with libpq pipeline mode.\n"
+                      "                             Only used when each row commits on its own.  0 turns it off.  Optional.\n"
+                      "                  --optimistic: only update a row if it still has the ctid and xmin it was read\n"
+                      "                             with, so an application's update made after the read isn't overwritten.\n"
+                      "                             Rows changed since they were read are re-read and converted again after\n"
+                      "                             the table has been walked.  Takes no locks.  Optional.\n"
+                      "                  --conflict-retries: re-read rows that keep changing under --optimistic, or stay\n"
+                      "                             locked, this many times (default 3) before giving up on them.  Optional.\n"
+                      "                  --lock-timeout: give up on a write after waiting this many milliseconds for a row\n"
+                      "                             lock held by another transaction, and retry the row after the table has\n"
+                      "                             been walked, so one locked row doesn't stall the run.  Optional.\n"
+                      "                  --statement-timeout: give up on a write statement after this many milliseconds,\n"
+                      "                             and retry its rows the same way.  Optional.\n"
+                      "                  --skip-locked: read rows one at a time with for update skip locked, so rows\n"
+                      "                             locked by another transaction are retried later without waiting at all.\n"
+                      "                             Locks each row read for a moment.  Ignored with --batch-size and\n"
+                      "                             --scan=cursor, copy or ctid, which read many rows at a time.  Optional.\n"
+                      "                  --retry-backoff: wait this many milliseconds (default 1000) before the second\n"
+                      "                             round of retries, and twice as long before each round after.  Optional.\n"
+                      "                  --mode:    update (default) converts rows in place.  rebuild streams the whole table\n"
+                      "                             through the transcoder into a new shadow table with COPY, builds its\n"
+                      "                             indexes afterwards, replays the changes made meanwhile and swaps it in\n"
+                      "                             for the table, keeping the original as <table>_transcoder_old.  Not with\n"
+                      "                             --report, --one-row, --restart, --limit, --scan=ctid, --optimistic,\n"
+                      "                             --lock-timeout, --statement-timeout, --skip-locked or --non-ascii-only,\n"
+                      "                             since every row is copied, and the --write and commit options are\n"
+                      "                             ignored.  Optional.\n"
+                      "                  --trust-utf8: keep values that are already valid UTF-8 as they are, without\n"
+                      "                             running charset detection, which can take valid UTF-8 for a Latin\n"
+                      "                             encoding.  Optional.\n"
+                      "                  --non-ascii-only: only read rows where a character-based column has a\n"
+                      "                             non-ASCII character; pure ASCII rows are skipped by the database\n"
+                      "                             but still counted as visited.  --limit counts the rows read.  Optional.\n"
+                      "                  --skip-ascii-columns: only send the character-based column values that have a\n"
+                      "                             non-ASCII character; pure ASCII values are neither read, logged nor\n"
+                      "                             rewritten.  Saves reading wide text columns that don't need it.  Optional.\n"
                       "                  --force:   force transcoding to UTF8 by dropping invalid, illegal, or unassigned bytes.  Optional.\n"
                       "                  --report:  report detected character sets but do not transcode or update data.  Optional.\n"
                       "                  --debug:   print debug messages.  Optional.\n"
@@ -98,13 +204,25 @@ void process_long_options(const int argc, const char** argv)
     field.oneRowKey = NULL;
     field.restartKey = NULL;
     field.limit = 0;
+    field.batchSize = 0;
+    field.scan = SCAN_KEYSET;
+    field.writeBatchSize = 0;
+    field.write = WRITE_UPDATE;
+    field.commitEvery = 0;
+    field.commitInterval = 0;
+    field.pipelineDepth = DEFAULT_PIPELINE_DEPTH;
+    field.conflictRetries = DEFAULT_CONFLICT_RETRIES;
+    field.lockTimeout = 0;
+    field.statementTimeout = 0;
+    field.retryBackoff = DEFAULT_RETRY_BACKOFF;
+    field.mode = MODE_UPDATE;
 
     while (1)
     {
         /* getopt_long stores the option index here. */
         int option_index = 0;
 
-        c = getopt_long (argc, (char *const *) argv, "d:s:t:o:r:l:e:",
+        c = getopt_long (argc, (char *const *) argv, "d:s:t:o:r:l:e:b:c:w:W:C:I:P:R:L:T:B:M:",
         long_options, &option_index);
 
         /* Detect the end of the options. */
@@ -167,6 +285,106 @@ void process_long_options(const int argc, const char** argv)
                 strcpy(field.hint, optarg);
                 break;
 
+            case 'b':
+                printf ("option --batch-size with value '%s'\n", optarg);
+                // convert input to unsigned long, base 10
+                field.batchSize = strtoul(optarg, NULL, 10);
+                break;
+
+            case 'w':
+                printf ("option --write-batch-size with value '%s'\n", optarg);
+                // convert input to unsigned long, base 10
+                field.writeBatchSize = strtoul(optarg, NULL, 10);
+                break;
+
+            case 'C':
+                printf ("option --commit-every with value '%s'\n", optarg);
+                // convert input to unsigned long, base 10
+                field.commitEvery = strtoul(optarg, NULL, 10);
+                break;
+
+            case 'I':
+                printf ("option --commit-interval with value '%s'\n", optarg);
+                // convert input to unsigned long, base 10
+                field.commitInterval = strtoul(optarg, NULL, 10);
+                break;
+
+            case 'P':
+                printf ("option --pipeline-depth with value '%s'\n", optarg);
+                // convert input to unsigned long, base 10
+                field.pipelineDepth = strtoul(optarg, NULL, 10);
+                break;
+
+            case 'R':
+                printf ("option --conflict-retries with value '%s'\n", optarg);
+                // convert input to unsigned long, base 10
+                field.conflictRetries = strtoul(optarg, NULL, 10);
+                break;
+
+            case 'W':
+                printf ("option --write with value '%s'\n", optarg);
+                if (strcmp(optarg, "update") == 0)
+                    field.write = WRITE_UPDATE;
+                else if (strcmp(optarg, "copy") == 0)
+                    field.write = WRITE_COPY;
+                else
+                {
+                    fprintf(stderr, "ERROR: unknown write mode '%s'.\n", optarg);
+                    fprintf(stderr, usage, argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'L':
+                printf ("option --lock-timeout with value '%s'\n", optarg);
+                // convert input to unsigned long, base 10
+                field.lockTimeout = strtoul(optarg, NULL, 10);
+                break;
+
+            case 'T':
+                printf ("option --statement-timeout with value '%s'\n", optarg);
+                // convert input to unsigned long, base 10
+                field.statementTimeout = strtoul(optarg, NULL, 10);
+                break;
+
+            case 'B':
+                printf ("option --retry-backoff with value '%s'\n", optarg);
+                // convert input to unsigned long, base 10
+                field.retryBackoff = strtoul(optarg, NULL, 10);
+                break;
+
+            case 'M':
+                printf ("option --mode with value '%s'\n", optarg);
+                if (strcmp(optarg, "update") == 0)
+                    field.mode = MODE_UPDATE;
+                else if (strcmp(optarg, "rebuild") == 0)
+                    field.mode = MODE_REBUILD;
+                else
+                {
+                    fprintf(stderr, "ERROR: unknown mode '%s'.\n", optarg);
+                    fprintf(stderr, usage, argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'c':
+                printf ("option --scan with value '%s'\n", optarg);
+                if (strcmp(optarg, "keyset") == 0)
+                    field.scan = SCAN_KEYSET;
+                else if (strcmp(optarg, "cursor") == 0)
+                    field.scan = SCAN_CURSOR;
+                else if (strcmp(optarg, "copy") == 0)
+                    field.scan = SCAN_COPY;
+                else if (strcmp(optarg, "ctid") == 0)
+                    field.scan = SCAN_CTID;
+                else
+                {
+                    fprintf(stderr, "ERROR: unknown scan mode '%s'.\n", optarg);
+                    fprintf(stderr, usage, argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
             case '?':
                 fprintf(stderr, usage, argv[0]);
                 exit(EXIT_FAILURE);
@@ -177,12 +395,79 @@ void process_long_options(const int argc, const char** argv)
         }
     }
 
+    // a rebuild reads the table with one COPY and writes the shadow table
+    // with another, in one transaction, so the row writer isn't used
+    if (field.mode == MODE_REBUILD &&
+        (field.write != WRITE_UPDATE || field.writeBatchSize || field.commitEvery ||
+         field.commitInterval || field.asyncCommit ||
+         field.pipelineDepth != DEFAULT_PIPELINE_DEPTH ||
+         field.scan == SCAN_CURSOR || field.scan == SCAN_COPY))
+    {
+        puts ("write, write-batch-size, commit-every, commit-interval, async-commit, pipeline-depth\n"
+              "and scan options are ignored by --mode=rebuild");
+        field.write = WRITE_UPDATE;
+        field.writeBatchSize = 0;
+        field.commitEvery = 0;
+        field.commitInterval = 0;
+        field.asyncCommit = 0;
+        field.pipelineDepth = DEFAULT_PIPELINE_DEPTH;
+        field.scan = SCAN_KEYSET;
+    }
+
+    if (field.scan == SCAN_CTID && field.batchSize == 0)
+        field.batchSize = DEFAULT_CTID_BLOCKS;
+    else if (field.scan != SCAN_KEYSET && field.batchSize == 0)
+        field.batchSize = DEFAULT_FETCH_SIZE;
+
+    if (field.write == WRITE_COPY && field.writeBatchSize == 0)
+        field.writeBatchSize = DEFAULT_COPY_FLUSH_SIZE;
+    else if (field.writeBatchSize == 0)
+        field.writeBatchSize = DEFAULT_WRITE_BATCH_SIZE;
+
     if (field.force)
         puts ("force flag is set");
 
     if (field.report)
         puts ("report flag is set");
 
+    if (field.trustUtf8)
+        puts ("trust-utf8 flag is set");
+
+    if (field.nonAsciiOnly)
+        puts ("non-ascii-only flag is set");
+
+    if (field.skipAsciiColumns)
+        puts ("skip-ascii-columns flag is set");
+
+    if (field.asyncCommit)
+        puts ("async-commit flag is set");
+
+    if (field.optimistic && field.scan == SCAN_CTID)
+    {
+        // every write is already found by the ctid and xmin it was read
+        // with, and the rows it misses re-read by the table's unique key
+        puts ("optimistic flag is ignored by --scan=ctid");
+        field.optimistic = 0;
+    }
+    else if (field.optimistic)
+        puts ("optimistic flag is set");
+
+    if (field.skipLocked && field.report)
+    {
+        // nothing is written, so there's nothing to wait for
+        puts ("skip-locked flag is ignored by --report");
+        field.skipLocked = 0;
+    }
+    else if (field.skipLocked && field.batchSize > 0 && !field.oneRowKey && field.mode != MODE_REBUILD)
+    {
+        // the batch readers read many rows per query without locking
+        // them, so only the re-reads would skip locked rows
+        puts ("skip-locked flag is ignored by --batch-size and --scan=cursor|copy|ctid");
+        field.skipLocked = 0;
+    }
+    else if (field.skipLocked)
+        puts ("skip-locked flag is set");
+
     if (field.debug)
         puts ("debug flag is set");
 
@@ -213,6 +498,19 @@ void process_long_options(const int argc, const char** argv)
         fprintf(stderr, usage, argv[0]);
         exit(EXIT_FAILURE);
     }
+
+    // a rebuild copies every row, by the unique key, and replaces the table
+    if (field.mode == MODE_REBUILD &&
+        (field.report || field.oneRowKey || field.restartKey || field.limit || field.scan == SCAN_CTID ||
+         field.optimistic || field.lockTimeout || field.statementTimeout || field.skipLocked ||
+         field.nonAsciiOnly))
+    {
+        fprintf(stderr, "ERROR: --mode=rebuild can't be combined with --report, --one-row, --restart, --limit,\n"
+                        "       --scan=ctid, --optimistic, --lock-timeout, --statement-timeout, --skip-locked\n"
+                        "       or --non-ascii-only.\n");
+        fprintf(stderr, usage, argv[0]);
+        exit(EXIT_FAILURE);
+    }
 }
 
 PGresult * pq_query(PGconn* cxn, const char* query)
@@ -251,6 +549,101 @@ PGresult * pq_vaquery(PGconn* cxn, const char* format, ...)
     return(result);
 }
 
+// like pq_vaquery, but sends paramValues as text bind parameters $1..$n
+// instead of interpolating them into the query string, and gets the
+// results in resultFormat, TEXT_RESULTS or BINARY_RESULTS
+PGresult * pq_vaqueryparams(PGconn* cxn, int nParams, const char* const* paramValues,
+                            int resultFormat, const char* format, ...)
+{
+    va_list argv;
+    char *query = NULL;
+    PGresult *result = NULL;
+
+    va_start(argv, format);
+    if (vasprintf(&query, format, argv) < 0)
+        query = NULL;
+    va_end(argv);
+
+    if (!query)
+        return(0);
+
+    result = PQexecParams(cxn, query, nParams,
+                          NULL,         // let the server infer the param types
+                          paramValues,
+                          NULL,         // text params don't need lengths
+                          NULL,         // all text params
+                          resultFormat);
+
+    free(query);
+
+    // free result in caller
+    return(result);
+}
+
+// format a query like pq_vaquery and prepare it as stmtName on cxn, so
+// it is parsed and planned once per connection.  exits on failure
+void pq_vaprepare(PGconn* cxn, const char* stmtName, int nParams,
+                  const char* format, ...)
+{
+    va_list argv;
+    char *query = NULL;
+    PGresult *result = NULL;
+
+    va_start(argv, format);
+    if (vasprintf(&query, format, argv) < 0)
+        query = NULL;
+    va_end(argv);
+
+    if (!query)
+    {
+        perror("vasprintf - prepare");
+        exit(EXIT_FAILURE);
+    }
+
+    // let the server infer the param types from the casts in the query
+    result = PQprepare(cxn, stmtName, query, nParams, NULL);
+
+    if (PQresultStatus(result) != PGRES_COMMAND_OK)
+    {
+        LOGSTDERR(ERROR, PQresStatus(PQresultStatus(result)),
+            "Cannot prepare %s: %s\n%s", stmtName, PQerrorMessage(cxn), query);
+        PQclear(result);
+        free(query);
+        exit(EXIT_FAILURE);
+    }
+
+    if (field.debug)
+        LOGSTDERR(DEBUG, PQresStatus(PQresultStatus(result)),
+            "Prepared %s: %s", stmtName, query);
+
+    PQclear(result);
+    free(query);
+}
+
+// run a statement prepared with pq_vaprepare with text parameters,
+// getting the results in resultFormat, TEXT_RESULTS or BINARY_RESULTS
+PGresult * pq_execprepared(PGconn* cxn, const char* stmtName,
+                           int nParams, const char* const* paramValues,
+                           int resultFormat)
+{
+    // free result in caller
+    return PQexecPrepared(cxn, stmtName, nParams, paramValues,
+                          NULL, NULL, resultFormat);
+}
+
+// like pq_execprepared, but each parameter has its own length and
+// format, TEXT_RESULTS or BINARY_RESULTS, so binary values are sent as
+// their raw bytes
+PGresult * pq_execpreparedparams(PGconn* cxn, const char* stmtName,
+                                 int nParams, const char* const* paramValues,
+                                 const int* paramLengths, const int* paramFormats,
+                                 int resultFormat)
+{
+    // free result in caller
+    return PQexecPrepared(cxn, stmtName, nParams, paramValues,
+                          paramLengths, paramFormats, resultFormat);
+}
+
 char * pq_escape (PGconn* cxn, const char* input, int len)
 {
     char *output;
@@ -322,3 +715,150 @@ char* concat (const char *str, ...)
 
   return result;
 }
+
+// split str on each occurrence of sep and append a copy of each
+// element to v.  v is initialized with type "char*" and must be freed
+// with vector_free in the caller.  returns the number of elements
+unsigned int splitString(Vector* v, const char* str, const char* sep)
+{
+    const char* start = str;
+    const char* end = NULL;
+    size_t sepLen = strlen(sep);
+
+    vector_init(v, "char*", 0);
+
+    if (str == NULL || *str == '\0')
+        return v->size;
+
+    while ((end = strstr(start, sep)) != NULL)
+    {
+        vector_append(v, (void *) strndup(start, end - start));
+        start = end + sepLen;
+    }
+
+    vector_append(v, (void *) strdup(start));
+
+    return v->size;
+}
+
+// append n bytes of data to the growing buffer *buf, which has *len
+// bytes in *cap bytes, and keep it NUL terminated.  batch updates and
+// staging copies are built from thousands of pieces, so this avoids
+// copying the whole buffer for each one
+void appendBytes(char** buf, size_t* len, size_t* cap, const void* data, size_t n)
+{
+    if (*len + n + 1 > *cap)
+    {
+        while (*len + n + 1 > *cap)
+            *cap = (*cap ? *cap * 2 : 1024);
+
+        *buf = realloc(*buf, *cap);
+
+        if (*buf == NULL)
+        {
+            perror("realloc - append bytes");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    memcpy(*buf + *len, data, n);
+    *len += n;
+    (*buf)[*len] = '\0';
+}
+
+// append a big-endian 16 or 32 bit integer to a binary COPY row
+void appendCopyInt(char** buf, size_t* len, size_t* cap, int size, long value)
+{
+    unsigned char bytes[4] = {0};
+    int i = 0;
+
+    for (i = 0; i < size; i++)
+        bytes[i] = (unsigned char) (value >> (8 * (size - 1 - i)));
+
+    appendBytes(buf, len, cap, bytes, size);
+}
+
+// append a field to a binary COPY row: its 32 bit length, -1 for NULL,
+// and that many bytes
+void appendCopyField(char** buf, size_t* len, size_t* cap,
+                     const char* value, long length)
+{
+    appendCopyInt(buf, len, cap, 4, (value ? length : -1));
+
+    if (value)
+        appendBytes(buf, len, cap, value, length);
+}
+
+// read a big-endian 16 or 32 bit integer of a binary COPY row at *pos,
+// and advance *pos past it.  returns false if the row is too short
+bool nextCopyInt(const char** pos, const char* end, int size, long* value)
+{
+    const unsigned char* p = (const unsigned char*) *pos;
+    int i = 0;
+
+    if (end - *pos < size)
+        return false;
+
+    *value = 0;
+
+    for (i = 0; i < size; i++)
+        *value = (*value << 8) | p[i];
+
+    // sign extend, since -1 marks a NULL field or the end of the data
+    if (size == 2)
+        *value = (int16_t) *value;
+    else
+        *value = (int32_t) *value;
+
+    *pos += size;
+    return true;
+}
+
+// split a binary COPY row at buf into its fields' bytes and lengths, -1
+// for NULL, skipping the file header in front of the first row.  returns
+// 1 for a row, 0 for the trailer, and -1 if the data is malformed
+int parseCopyRow(const char* buf, int len, bool* headerRead, int fieldCount,
+                 const char** values, long* lengths)
+{
+    const char* pos = buf;
+    const char* end = buf + len;
+    long count = 0;
+    long length = 0;
+    int col = 0;
+
+    // signature, flags and header extension length
+    if (!*headerRead)
+    {
+        if (len < COPY_BINARY_HEADER_LEN ||
+            memcmp(pos, COPY_BINARY_SIGNATURE, COPY_BINARY_SIGNATURE_LEN) != 0)
+            return -1;
+
+        pos += COPY_BINARY_SIGNATURE_LEN + 4;
+        nextCopyInt(&pos, end, 4, &length);
+        pos += length;
+
+        *headerRead = true;
+    }
+
+    if (!nextCopyInt(&pos, end, 2, &count))
+        return -1;
+
+    if (count == -1)
+        return 0;
+
+    if (count != fieldCount)
+        return -1;
+
+    for (col = 0; col < fieldCount; col++)
+    {
+        if (!nextCopyInt(&pos, end, 4, &lengths[col]) || lengths[col] > end - pos)
+            return -1;
+
+        values[col] = pos;
+
+        if (lengths[col] > 0)
+            pos += lengths[col];
+    }
+
+    return 1;
+}
@@ -39,6 +39,56 @@ MODIFICATIONS.
 #include <getopt.h>
 
 #include "log.h"
+#include "vector.h"
+
+// row scan modes, see --scan
+#define SCAN_KEYSET 0   // keyset pagination on the shortest unique key
+#define SCAN_CURSOR 1   // server-side cursor over the whole table
+#define SCAN_COPY   2   // COPY (select ...) TO STDOUT over the whole table
+#define SCAN_CTID   3   // heap block ranges in physical order; no unique key needed
+
+// row write modes, see --write
+#define WRITE_UPDATE 0  // update statements, one per row or per --write-batch-size rows
+#define WRITE_COPY   1  // COPY into a staging table, applied with one update per flush
+
+// run modes, see --mode
+#define MODE_UPDATE  0  // convert rows in place
+#define MODE_REBUILD 1  // copy the table, converted, into a shadow table and swap it in
+
+// rows per FETCH, or per batch of COPY rows, when --scan=cursor or
+// --scan=copy is given without --batch-size
+#define DEFAULT_FETCH_SIZE 1000
+
+// heap blocks per range when --scan=ctid is given without --batch-size
+#define DEFAULT_CTID_BLOCKS 128
+
+// rows per update statement when --write-batch-size isn't given, i.e.
+// one update per row
+#define DEFAULT_WRITE_BATCH_SIZE 1
+
+// rows per staging flush when --write=copy is given without --write-batch-size
+#define DEFAULT_COPY_FLUSH_SIZE 10000
+
+// single row updates sent per pipeline when --pipeline-depth isn't given
+#define DEFAULT_PIPELINE_DEPTH 100
+
+// times rows changed since they were read are re-read under --optimistic
+// when --conflict-retries isn't given
+#define DEFAULT_CONFLICT_RETRIES 3
+
+// milliseconds to wait before the second round of re-reads when
+// --retry-backoff isn't given; doubled for each round after
+#define DEFAULT_RETRY_BACKOFF 1000
+
+// result and parameter format codes for pq_vaqueryparams and pq_execprepared[params]
+#define TEXT_RESULTS    0
+#define BINARY_RESULTS  1
+
+// binary COPY file header: signature, 32 bit flags and 32 bit length of
+// the header extension that follows
+#define COPY_BINARY_SIGNATURE       "PGCOPY\n\377\r\n"
+#define COPY_BINARY_SIGNATURE_LEN   11
+#define COPY_BINARY_HEADER_LEN      (COPY_BINARY_SIGNATURE_LEN + 4 + 4)
 
 struct GlobalArgs
 {
@@ -48,10 +98,28 @@ struct GlobalArgs
         char *oneRowKey;
         char *restartKey;
         unsigned long limit;
+        unsigned long batchSize;
+        unsigned long writeBatchSize;
+        unsigned long commitEvery;
+        unsigned long commitInterval;
+        unsigned long pipelineDepth;
+        unsigned long conflictRetries;
+        unsigned long lockTimeout;
+        unsigned long statementTimeout;
+        unsigned long retryBackoff;
+        int  write;
+        int  scan;
+        int  mode;
         char *hint;
         int  report;
         int  debug;
         int  force;
+        int  nonAsciiOnly;
+        int  skipAsciiColumns;
+        int  asyncCommit;
+        int  optimistic;
+        int  skipLocked;
+        int  trustUtf8;
         int  help;
 } field;
 
@@ -59,7 +127,25 @@ void process_long_options(const int argc, const char** argv);
 
 PGresult * pq_query(PGconn* cxn, const char* query);
 PGresult * pq_vaquery(PGconn* cxn, const char* format, ...);
+PGresult * pq_vaqueryparams(PGconn* cxn, int nParams, const char* const* paramValues,
+                            int resultFormat, const char* format, ...);
+void pq_vaprepare(PGconn* cxn, const char* stmtName, int nParams,
+                  const char* format, ...);
+PGresult * pq_execprepared(PGconn* cxn, const char* stmtName,
+                           int nParams, const char* const* paramValues,
+                           int resultFormat);
+PGresult * pq_execpreparedparams(PGconn* cxn, const char* stmtName,
+                                 int nParams, const char* const* paramValues,
+                                 const int* paramLengths, const int* paramFormats,
+                                 int resultFormat);
 char * pq_escape (PGconn* cxn, const char* input, int len);
 char* concat (const char *str, ...);
+unsigned int splitString(Vector* v, const char* str, const char* sep);
+void appendBytes(char** buf, size_t* len, size_t* cap, const void* data, size_t n);
+void appendCopyInt(char** buf, size_t* len, size_t* cap, int size, long value);
+void appendCopyField(char** buf, size_t* len, size_t* cap, const char* value, long length);
+bool nextCopyInt(const char** pos, const char* end, int size, long* value);
+int parseCopyRow(const char* buf, int len, bool* headerRead, int fieldCount,
+                 const char** values, long* lengths);
 
 #endif // #ifndef _TRANSCODER_UTILS_H_
@@ -15,6 +15,14 @@
 #include "transcoder-utils.h"
 #include "log.h"
 #include "vector.h"
+#include "validate.h"
+
+// values transcode() passed through as pure ASCII, see transcodeAsciiValues(),
+// and under --trust-utf8 as valid UTF-8, see transcodeUtf8Values(), and
+// values it converted with a generated table, see transcodeTableValues()
+static unsigned long asciiValues = 0;
+static unsigned long utf8Values = 0;
+static unsigned long tableValues = 0;
 
 // PG connections
 extern PGconn *readCxn;
@@ -52,6 +60,8 @@ PGconn* openDbConnection(const char* dsn)
 void clean_exit(int exitStatus)
 {
     // clean up
+    convert_close_cache();
+
     if (readCxn)
         PQfinish(readCxn);
 
@@ -165,6 +175,57 @@ const char* getShortestUniqueIndex(const char* schema, const char* table,
     return *shortestUniqueIndexCast;
 }
 
+// build a sql expression that yields the unique key values of a row as
+// cast literals, the same format get_next_shortest_unique_key_values returns,
+// so the key can be read without a catalog lookup per row
+//
+//   quote_nullable(c1) || '::integer' || ', ' || quote_nullable(c2) || '::text'
+char* constructUkValuesExpr(const char* uniqueKeyCols, const char* uniqueKeyDataTypes)
+{
+    Vector cols;
+    Vector types;
+    char* expr = NULL;
+    char* tmp = NULL;
+    int i = 0;
+
+    splitString(&cols, uniqueKeyCols, ", ");
+    splitString(&types, uniqueKeyDataTypes, ", ");
+
+    if (cols.size == 0 || cols.size != types.size)
+    {
+        LOGSTDERR(ERROR, "UNIQUE_KEY_MISMATCH",
+            "Unique key has %d column(s) but %d data type(s): (%s) (%s)",
+            cols.size, types.size, uniqueKeyCols, uniqueKeyDataTypes);
+        clean_exit(EXIT_FAILURE);
+    }
+
+    expr = calloc(sizeof(char), 1);
+
+    for (i = 0; i < cols.size; i++)
+    {
+        tmp = expr;
+        expr = concat(tmp,
+                      (i > 0 ? " || ', ' || " : ""),
+                      "quote_nullable(", (const char*) cols.data[i], ") || '::",
+                      (const char*) types.data[i], "'",
+                      (char*) NULL);
+        free((void *) tmp);
+
+        if (expr == NULL)
+        {
+            LOGSTDERR(ERROR, "STRING_CONCAT_FAILED",
+                "Unique key values expression is NULL. Aborting...", NULL);
+            clean_exit(EXIT_FAILURE);
+        }
+    }
+
+    vector_free(&cols);
+    vector_free(&types);
+
+    // free in caller
+    return expr;
+}
+
 void getCBColNames(Vector* cn, const char* schema, const char* table)
 {
     // query results
@@ -229,11 +290,55 @@ void getCBColNames(Vector* cn, const char* schema, const char* table)
     PQclear(readResult);
 }
 
+void prepareReadQuery(const char* readQuery,
+                      const char* fullTableName,
+                      const char* uniqueKeyCols,
+                      const char* ukParamList,
+                      int ukColCount)
+{
+    // parse and plan the read query once; the key is bound per row
+    pq_vaprepare(readCxn, READ_STMT_NAME, ukColCount, readQuery,
+                 fullTableName, uniqueKeyCols, ukParamList);
+
+    // under --skip-locked, tells a locked row from a deleted one
+    if (field.skipLocked)
+        pq_vaprepare(readCxn, EXISTS_STMT_NAME, ukColCount,
+                     "select 1 from %s where (%s) = (%s);",
+                     fullTableName, uniqueKeyCols, ukParamList);
+}
+
+// true if the row with the given key exists.  under --skip-locked, a row
+// getCBColValues() didn't return but that exists is locked by another
+// transaction
+bool rowExists(const Vector* key, const char* uniqueKeyValues)
+{
+    PGresult *readResult = NULL;
+    bool exists = false;
+
+    readResult = pq_execprepared(readCxn, EXISTS_STMT_NAME,
+                            key->size, (const char* const*) key->data,
+                            TEXT_RESULTS);
+
+    if (PQresultStatus(readResult) != PGRES_TUPLES_OK)
+    {
+        LOGSTDERR(ERROR, PQresStatus(PQresultStatus(readResult)),
+        "Row exists query failed: %s(%s)", EXISTS_STMT_NAME, uniqueKeyValues);
+        clean_exit(EXIT_FAILURE);
+    }
+
+    exists = (PQntuples(readResult) > 0);
+
+    PQclear(readResult);
+
+    return exists;
+}
+
 void getCBColValues(Vector *cv,
-                    const char* readQuery,
-                    const char* fullTableName,
-                    const char* uniqueKeyCols,
-                    const char* uniqueKeyValues)
+                    char** ctid,
+                    char** xmin,
+                    const Vector* key,
+                    const char* uniqueKeyValues,
+                    const PGresult* cbColFields)
 {
     // query results
     PGresult    *readResult = NULL;
@@ -246,12 +351,11 @@ void getCBColValues(Vector *cv,
 
     // records processed
     int readRecCount = 0;
-    int readColCount = 0;
 
-    readResult = pq_vaquery(readCxn, readQuery,
-                            fullTableName,
-                            uniqueKeyCols,
-                            uniqueKeyValues);
+    // text, varchar and bpchar values come back as raw bytes with a length
+    readResult = pq_execprepared(readCxn, READ_STMT_NAME,
+                            key->size, (const char* const*) key->data,
+                            BINARY_RESULTS);
 
     cmdStatus = PQcmdStatus(readResult);
     cmdTuples = PQcmdTuples(readResult);
@@ -259,7 +363,7 @@ void getCBColValues(Vector *cv,
     if (PQresultStatus(readResult) != PGRES_TUPLES_OK)
     {
         LOGSTDERR(ERROR, PQresStatus(PQresultStatus(readResult)),
-        "Get column value(s) query failed: %s", readQuery);
+        "Get column value(s) query failed: %s(%s)", READ_STMT_NAME, uniqueKeyValues);
         clean_exit(EXIT_FAILURE);
     }
     else if (field.debug)
@@ -267,12 +371,11 @@ void getCBColValues(Vector *cv,
         int numtups = atoi(cmdTuples);
 
         LOGSTDERR(DEBUG, PQresStatus(PQresultStatus(readResult)),
-        "Get column values:\n%s\n%s\n(%d %s)\n",
-        readQuery, cmdStatus, numtups, (numtups == 1 ? "row" : "rows"));
+        "Get column values:\n%s(%s)\n%s\n(%d %s)\n",
+        READ_STMT_NAME, uniqueKeyValues, cmdStatus, numtups, (numtups == 1 ? "row" : "rows"));
     }
 
     readRecCount = PQntuples(readResult);
-    readColCount = PQnfields(readResult);
 
     if (readRecCount > 1)
     {
@@ -281,265 +384,429 @@ void getCBColValues(Vector *cv,
         clean_exit(EXIT_FAILURE);
     }
 
-    // PQntuples counts from 0
+    // PQntuples counts from 0.  first columns are the row's ctid and xmin
     for (row = 0; row < readRecCount; row++)
     {
-        for(col = 0; col < readColCount; col++)
-        {
-            // pointer to hold result struct
-            PGColResult* colResult = malloc(sizeof(PGColResult));
-
-            // populate struct
-            colResult->fname     = strdup(PQfname(readResult, col));
-            colResult->fnumber   = PQfnumber(readResult, colResult->fname);
-            colResult->ftable    = PQftable(readResult, col);
-            colResult->ftablecol = PQftablecol(readResult, col);
-            colResult->fformat   = PQfformat(readResult, col);
-            colResult->ftype     = PQftype(readResult, col);
-            colResult->fmod      = PQfmod(readResult, col);
-            colResult->fsize     = PQfsize(readResult, col);
-            colResult->isnull    = (PQgetisnull(readResult, row, col) ? true: false);
-            colResult->length    = PQgetlength(readResult, row, col);
-            colResult->value     = strdup(PQgetvalue(readResult, row, col));
-
-            vector_append(cv, (void *) colResult);
-        }
+        *ctid = strdup(PQgetvalue(readResult, row, col));
+        *xmin = strdup(PQgetvalue(readResult, row, col + 1));
+        appendCBColResults(cv, readResult, row, col + 2, cbColFields);
     }
 
     PQclear(readResult);
 }
 
-char* constructWriteQuery(const char* fullTableName,
-                     const Vector* colValues,
-                     const char* uniqueKeyCols,
-                     const char* uniqueKeyValues)
+// number of bytes of a column value to write: the whole value, or for
+// a varchar(n) or char(n) column as much as fits, with a warning
+int colResultWriteLength(const PGColResult* colResult)
 {
-    /* construct write query from character-based column names
+    char* fname  = colResult->fname;
+    int   fsize  = colResult->fsize;
+    int   fmod   = colResult->fmod;
+    bool  isnull = colResult->isnull;
+    char* value  = colResult->value;
+    int   length = colResult->length;
+
+    int   allowedLength = 0;
+
+    // alert if data is too long for column
+    if ((isnull == false && length > 0)  // not empty string
+         && (fsize == -1 && fmod != -1)) // not a text field
+    {
+        allowedLength = fmod - 4;        // subtract 4 bytes for length in varlena
 
-        "update %s"
-        "   set <colx> = '%s', ..."
-        " where (%s) = (%s);"
-    */
+        if (length > allowedLength)      // over variable length field size
+        {
+            char* tmp = calloc(sizeof(char), length + 1);
+            tmp = strncpy(tmp, value, allowedLength);
+
+            LOGSTDERR(WARNING, "STRING_DATA_RIGHT_TRUNCATION",
+                "Value too long for data type.  Data will be truncated and may be invalid UTF8.\n"
+                "Column: %s, Length: %d\n"
+                "Converted Value Length: %d\n"
+                "Original Value: %s\n"
+                "Converted & Truncated Value: %s\n",
+                fname, allowedLength,
+                strlen(tmp),
+                value,
+                tmp);
+
+            free((void *) tmp);
+
+            // value will be truncated
+            return allowedLength;
+        }
+    }
 
-    int sqlLen = 0, i = 0;
-    const char update_format[] = "update %s set ";
-    const char column_format[] = " %s = %s ";
-    const char where_format[]  = " where (%s) = (%s);";
+    return length;
+}
 
-    char* update = NULL;
-    char* column = NULL;
-    char* ptr = NULL;
-    char* where  = NULL;
-    char* sql = NULL;
-    char comma = ',';
+// quote a column value as a SQL literal for a write query: NULL, '' or
+// the escaped value, truncated to fit a varchar(n) or char(n) column
+char* quoteColResult(const PGColResult* colResult)
+{
     char* quotedVal = NULL;
 
-    // start of update statement
-    if (!(asprintf(&update, update_format, fullTableName)))
+    bool  isnull = colResult->isnull;
+    int   length = colResult->length;
+
+    // value is NULL
+    if (isnull == true)
     {
-        perror("asprintf - update");
-        clean_exit(EXIT_FAILURE);
+        quotedVal = strdup("NULL");
     }
-
-    // where clause
-    if (!(asprintf(&where, where_format, uniqueKeyCols, uniqueKeyValues)))
+    // value is empty string
+    else if (length == 0)
     {
-        perror("asprintf - where");
-        clean_exit(EXIT_FAILURE);
+        quotedVal = strdup("''");
+    }
+    // not an empty string
+    else
+    {
+        quotedVal = pq_escape(writeCxn, colResult->value, colResultWriteLength(colResult));
     }
 
-    sqlLen = strlen(update) + strlen(where);
+    // free in caller
+    return quotedVal;
+}
+
+// build the select list of the character-based columns.  with
+// --skip-ascii-columns each column is sent only if it holds a non-ASCII
+// character, followed by a flag telling which columns were sent:
+//
+//   case when c1::text ~ '<non-ascii>' then c1 end as c1, c1::text ~ '<non-ascii>', ...
+//
+// the flag is NULL for a NULL value and false for a pure ASCII one
+char* constructCBColList(const Vector* cbColNames)
+{
+    char* list = NULL;
+    char* tmp = NULL;
+    int i = 0;
+
+    list = calloc(sizeof(char), 1);
 
-    // calc sql string length
-    for (i = 0; i < colValues->size; i++)
+    for (i = 0; i < cbColNames->size; i++)
     {
-        PGColResult* colResult = (PGColResult*) colValues->data[i];
+        const char* col = (const char*) cbColNames->data[i];
 
-        char* fname  = colResult->fname;
-        bool  isnull = colResult->isnull;
-        char* value  = colResult->value;
-        int   length = colResult->length;
+        tmp = list;
 
-        // value is not NULL or ""
-        if (isnull == false && length > 0 )
-        {
-            quotedVal = pq_escape(writeCxn, value, length);
-        }
-        // value is NULL, not ""
-        else if (isnull == true)
-        {
-            quotedVal = strdup("NULL");
-        }
-        // value is "", not NULL
-        else if (isnull == false && length == 0)
-        {
-            quotedVal = strdup("''");
-        }
+        if (field.skipAsciiColumns)
+            list = concat(tmp, (i > 0 ? ", " : ""),
+                          "case when ", col, "::text ~ '" NON_ASCII_PATTERN "'"
+                          " then ", col, " end as ", col, ", ",
+                          col, "::text ~ '" NON_ASCII_PATTERN "'",
+                          (char*) NULL);
+        else
+            list = concat(tmp, (i > 0 ? ", " : ""), col, (char*) NULL);
 
-        sqlLen += strlen(fname) +
-                  strlen(quotedVal) +
-                  5;  // 4 spaces  & equals sign
+        free((void *) tmp);
+    }
+
+    // free in caller
+    return list;
+}
 
-        free((void *) quotedVal);
+// get the descriptions of the plain character-based columns from an empty
+// binary result.  values selected through a case expression lose their
+// typmod, which the write query needs to truncate varchar(n) values
+PGresult* describeCBCols(const Vector* cbColNames, const char* fullTableName)
+{
+    PGresult* readResult = NULL;
+    char* cols = NULL;
+    int i = 0;
+
+    cols = calloc(sizeof(char), 1);
+
+    for (i = 0; i < cbColNames->size; i++)
+    {
+        char* tmp = cols;
+        cols = concat(tmp, (i > 0 ? ", " : ""), (const char*) cbColNames->data[i], (char*) NULL);
+        free((void *) tmp);
     }
 
-    sql = malloc(sizeof(char) * sqlLen + 1);
-    memset(sql, 0, sqlLen + 1);
+    readResult = pq_vaqueryparams(readCxn, 0, NULL, BINARY_RESULTS,
+                                  "select %s from %s where false;",
+                                  cols, fullTableName);
 
-    strcat(sql, update);
-    if(strlen(sql) < strlen(update))
+    if (PQresultStatus(readResult) != PGRES_TUPLES_OK)
     {
-        perror("strcat - update");
+        LOGSTDERR(ERROR, PQerrorMessage(readCxn),
+            "Describe character-based columns query failed: %s", cols);
         clean_exit(EXIT_FAILURE);
     }
 
-    // build "set = ?" clauses
-    for(i = 0; i < colValues->size; i++)
+    free((void *) cols);
+
+    // free result in caller
+    return readResult;
+}
+
+// append the character-based column values of one row of a read query
+// result, starting at firstCol, to cols.  with cbColFields, from
+// describeCBCols(), the values come in value and flag pairs per
+// constructCBColList(), and only the flagged ones are appended
+void appendCBColResults(Vector* cols, const PGresult* res, int row, int firstCol,
+                        const PGresult* cbColFields)
+{
+    int col = 0;
+    int i = 0;
+
+    if (cbColFields == NULL)
     {
-        PGColResult* colResult = (PGColResult*) colValues->data[i];
+        for (col = firstCol; col < PQnfields(res); col++)
+            vector_append(cols, (void *) newColResult(res, row, col));
 
-        char* fname  = colResult->fname;
-        int   fsize  = colResult->fsize;
-        int   fmod   = colResult->fmod;
-        bool  isnull = colResult->isnull;
-        char* value  = colResult->value;
-        int   length = colResult->length;
+        return;
+    }
 
-        int   allowedLength = 0;
+    for (i = 0, col = firstCol; col + 1 < PQnfields(res); i++, col += 2)
+    {
+        // binary boolean, one byte
+        if (PQgetisnull(res, row, col + 1) || PQgetvalue(res, row, col + 1)[0] != 1)
+            continue;
+
+        vector_append(cols,
+            (void *) newColResultFromField(cbColFields, i,
+                        PQgetvalue(res, row, col),
+                        PQgetlength(res, row, col),
+                        false));
+    }
+}
 
-        // alert if data is too long for column
-        if ((isnull == false && length > 0)  // not empty string
-             && (fsize == -1 && fmod != -1)) // not a text field
-        {
-            allowedLength = fmod - 4;        // subtract 4 bytes for length in varlena
-
-            if (length > allowedLength)      // over variable length field size
-            {
-                char* tmp = calloc(sizeof(char), length + 1);
-                tmp = strncpy(tmp, value, allowedLength);
-
-                LOGSTDERR(WARNING, "STRING_DATA_RIGHT_TRUNCATION",
-                    "Value too long for data type.  Data will be truncated and may be invalid UTF8.\n"
-                    "Column: %s, Length: %d\n"
-                    "Converted Value Length: %d\n"
-                    "Original Value: %s\n"
-                    "Converted & Truncated Value: %s\n",
-                    fname, allowedLength,
-                    strlen(tmp),
-                    value,
-                    tmp);
-
-                free((void *) tmp);
-
-                // quotedVal will be truncated
-                quotedVal = pq_escape(writeCxn, value, allowedLength);
-            }
-            else
-            {
-                // quotedVal is not  truncated
-                quotedVal = pq_escape(writeCxn, value, length);
-            }
-        }
-        // not an empty string and *is* a text field
-        else if ((isnull == false && length > 0)
-             && (fsize == -1 && fmod == -1))
-        {
-            quotedVal = pq_escape(writeCxn, value, length);
-        }
-        // value is NULL
-        else if (isnull == true)
-        {
-            quotedVal = strdup("NULL");
-        }
-        // value is empty string
-        else if (isnull == false && length == 0)
-        {
-            quotedVal = strdup("''");
-        }
+const char* constructReadQuery(const Vector* cbColNames)
+{
+/* construct read query from character-based column names
+
+    "select ctid::text, xmin::text, <colnames>"
+    "  from %s"
+    " where (%s) = (%s);";
+
+   with " for update skip locked" under --skip-locked
+*/
+
+    char* cols = NULL;
+    char* sql = NULL;
+
+    cols = constructCBColList(cbColNames);
+
+    sql = concat("select ctid::text, xmin::text, ", cols,
+                 "  from %s",
+                 " where (%s) = (%s)",
+                 (field.skipLocked ? " for update skip locked;" : ";"),
+                 (char*) NULL);
+
+    free((void *) cols);
+
+    if (field.debug)
+    {
+        LOGSTDERR(DEBUG, "Read SQL Query",
+                "%s", sql);
+    }
+
+    // free in caller
+    return sql;
+}
+
+// build the bind parameter list for a unique key, one parameter per
+// key column cast to the column's type, e.g. "$1::integer, $2::text"
+char* constructUkParamList(const char* uniqueKeyDataTypes)
+{
+    Vector types;
+    char* params = NULL;
+    char* tmp = NULL;
+    char* param = NULL;
+    int i = 0;
 
-        if (!(asprintf(&column, column_format,
-                       fname, quotedVal)))
+    splitString(&types, uniqueKeyDataTypes, ", ");
+
+    params = calloc(sizeof(char), 1);
+
+    for (i = 0; i < types.size; i++)
+    {
+        if (asprintf(&param, "%s$%d::%s",
+                     (i > 0 ? ", " : ""), i + 1,
+                     (const char*) types.data[i]) < 0)
         {
-            perror("asprintf - column");
+            perror("asprintf - param");
             clean_exit(EXIT_FAILURE);
         }
 
-        free((void *) quotedVal);
+        tmp = params;
+        params = concat(tmp, param, (char*) NULL);
+        free((void *) tmp);
+        free((void *) param);
+    }
 
-        // tack on a comma if more than one column
-        // but not the last column
-        if (colValues->size > 1 && i < colValues->size - 1)
-        {
-            ptr = column + strlen(column) - 1;
-            *ptr = comma;
-        }
+    vector_free(&types);
 
-        strcat(sql, column);
+    // free in caller
+    return params;
+}
 
-        free((void *) column);
+// build a predicate that is true when any character-based column holds
+// a byte outside 7-bit ASCII, e.g.
+//
+//   (c1::text ~ '[^\x01-\x7f]' or c2::text ~ '[^\x01-\x7f]')
+//
+// pure ASCII rows can't need transcoding, so --non-ascii-only leaves
+// them on the server
+char* constructNonAsciiFilter(const Vector* cbColNames)
+{
+    char* filter = NULL;
+    char* tmp = NULL;
+    int i = 0;
+
+    // no character-based columns, nothing can need transcoding
+    if (cbColNames->size == 0)
+        return strdup("false");
+
+    filter = strdup("(");
+
+    for (i = 0; i < cbColNames->size; i++)
+    {
+        tmp = filter;
+        filter = concat(tmp,
+                        (i > 0 ? " or " : ""),
+                        (const char*) cbColNames->data[i],
+                        "::text ~ '" NON_ASCII_PATTERN "'",
+                        (char*) NULL);
+        free((void *) tmp);
     }
 
-    strcat(sql, where);
+    tmp = filter;
+    filter = concat(tmp, ")", (char*) NULL);
+    free((void *) tmp);
 
     if (field.debug)
     {
-        fprintf(stderr, "%s\n", sql);
+        LOGSTDERR(DEBUG, "Non-ASCII Filter",
+                "%s", filter);
     }
 
-    free((void*) update);
-    free((void*) where);
-
     // free in caller
-    return sql;
+    return filter;
 }
 
-const char* constructReadQuery(const Vector* cbColNames)
+// count the rows from firstKeyValues through lastKeyValues, both
+// inclusive; NULL for either means the start or end of the table.
+// with --non-ascii-only this is the number of rows visited, including
+// the ones the filter kept on the server
+unsigned long countVisitedRows(const char* fullTableName,
+                               const char* uniqueKeyCols,
+                               const char* firstKeyValues,
+                               const char* lastKeyValues)
 {
-/* construct read query from character-based column names
+    // query results
+    PGresult *readResult = NULL;
 
-    "select <colnames>"
-    "  from %s"
-    " where (%s) = (%s);";
-*/
+    char* first = NULL;
+    char* last = NULL;
+    unsigned long visited = 0;
 
-    int len = 0, i = 0;
-    char* sql = NULL;
+    if (asprintf(&first, " and (%s) >= (%s)", uniqueKeyCols,
+                 (firstKeyValues ? firstKeyValues : "")) < 0 ||
+        asprintf(&last, " and (%s) <= (%s)", uniqueKeyCols,
+                 (lastKeyValues ? lastKeyValues : "")) < 0)
+    {
+        perror("asprintf - visited");
+        clean_exit(EXIT_FAILURE);
+    }
 
-    for(i = 0; i < cbColNames->size; i++)
-        len += strlen((const char*) cbColNames->data[i]);
+    readResult = pq_vaquery(readCxn, "select count(*) from %s where true%s%s;",
+                            fullTableName,
+                            (firstKeyValues ? first : ""),
+                            (lastKeyValues ? last : ""));
 
-    len +=  strlen("select ") +
-            strlen("  from %s") +
-            strlen(" where (%s) = (%s);") +
-            ((cbColNames->size - 1) * 2) +   // ", " comma space between cols
-            1;
+    if (PQresultStatus(readResult) != PGRES_TUPLES_OK || PQntuples(readResult) != 1)
+    {
+        LOGSTDERR(ERROR, PQerrorMessage(readCxn),
+            "Cannot count rows visited in %s", fullTableName);
+        clean_exit(EXIT_FAILURE);
+    }
 
-    sql = malloc(sizeof(char) * len);
-    memset(sql, 0, len);
+    visited = strtoul(PQgetvalue(readResult, 0, 0), NULL, 10);
 
-    strcat(sql, "select ");
+    PQclear(readResult);
+    free((void *) first);
+    free((void *) last);
 
-    for(i = 0; i < cbColNames->size; i++)
+    return visited;
+}
+
+// build the unique key column list with each column cast to text, e.g.
+// "c1::text, c2::text", so queries returning the key along with the
+// character-based columns can ask for every column in binary format
+char* constructUkTextCols(const char* uniqueKeyCols)
+{
+    Vector cols;
+    char* textCols = NULL;
+    char* tmp = NULL;
+    int i = 0;
+
+    splitString(&cols, uniqueKeyCols, ", ");
+
+    textCols = calloc(sizeof(char), 1);
+
+    for (i = 0; i < cols.size; i++)
     {
-        if (i > 0) strcat(sql, ", ");
-        strcat(sql, (const char*) cbColNames->data[i]);
+        tmp = textCols;
+        textCols = concat(tmp, (i > 0 ? ", " : ""),
+                          (const char*) cols.data[i], "::text",
+                          (char*) NULL);
+        free((void *) tmp);
     }
 
-    strcat(sql, "  from %s");
-    strcat(sql, " where (%s) = (%s);");
+    vector_free(&cols);
 
-    if (field.debug)
+    // free in caller
+    return textCols;
+}
+
+// replace the contents of key with the text values of ncols columns of
+// a query result, starting at firstCol.  NULL values are kept as NULL
+void setUniqueKeyTuple(Vector* key, const PGresult* res, int row,
+                       int firstCol, int ncols)
+{
+    int col = 0;
+
+    vector_clear(key);
+
+    for (col = firstCol; col < firstCol + ncols; col++)
     {
-        LOGSTDERR(DEBUG, "Read SQL Query",
-                "%s", sql);
+        if (PQgetisnull(res, row, col))
+            vector_append(key, NULL);
+        else
+            vector_append(key, (void *) strdup(PQgetvalue(res, row, col)));
     }
+}
 
-    // free in caller
-    return sql;
+// turn unique key values given as cast literals, e.g. from --restart,
+// into a typed key tuple that can be sent as bind parameters
+void getUniqueKeyTuple(Vector* key, const char* uniqueKeyValues)
+{
+    // query results
+    PGresult *readResult = NULL;
+
+    // let the server parse and cast the literals
+    readResult = pq_vaquery(readCxn, "select %s;", uniqueKeyValues);
+
+    if (PQresultStatus(readResult) != PGRES_TUPLES_OK || PQntuples(readResult) != 1)
+    {
+        LOGSTDERR(ERROR, PQerrorMessage(readCxn),
+            "Invalid unique key values: %s", uniqueKeyValues);
+        clean_exit(EXIT_FAILURE);
+    }
+
+    setUniqueKeyTuple(key, readResult, 0, 0, PQnfields(readResult));
+
+    PQclear(readResult);
 }
 
-char* getInitUniqueKeyValues(const char* schema, const char* table,
-                             const char* uniqueKeyCols)
+char* getInitUniqueKeyValues(Vector* key,
+                             const char* fullTableName,
+                             const char* uniqueKeyCols,
+                             const char* ukValuesExpr,
+                             const char* filter)
 {
     // query results
     PGresult    *readResult = NULL;
@@ -554,12 +821,22 @@ char* getInitUniqueKeyValues(const char* schema, const char* table,
 
     char* uniqueKeyValues = NULL;
 
-    // get starting row with lowest unique index value
+    // get starting row with lowest unique index value, as cast literals
+    // for logging and as a typed tuple for the next key query.
+    // the unique key was resolved once at startup, so this is a
+    // plain index probe
     const char initUkValsSql[] =
-        "select out_cast_min_uk_values"
-        "  from public.get_min_shortest_unique_key_values('%s', '%s');";
-
-    readResult = pq_vaquery(readCxn, initUkValsSql, schema, table);
+        "select %s, %s"
+        "  from %s"
+        "%s%s"
+        " order by %s"
+        " limit 1;";
+
+    readResult = pq_vaquery(readCxn, initUkValsSql,
+                        ukValuesExpr, uniqueKeyCols,
+                        fullTableName,
+                        (filter ? " where " : ""), (filter ? filter : ""),
+                        uniqueKeyCols);
 
     if (PQresultStatus(readResult) != PGRES_TUPLES_OK)
     {
@@ -568,25 +845,33 @@ char* getInitUniqueKeyValues(const char* schema, const char* table,
         clean_exit(EXIT_FAILURE);
     }
 
-    if (PQgetisnull(readResult, row, col))
+    readRecCount = PQntuples(readResult);
+    readColCount = PQnfields(readResult);
+
+    // with a filter, no row needing transcoding isn't an error
+    if (filter && readRecCount == 0)
+    {
+        PQclear(readResult);
+        return NULL;
+    }
+
+    if (readRecCount < 1 || PQgetisnull(readResult, row, col))
     {
         LOGSTDERR(ERROR, PQresStatus(PQresultStatus(readResult)),
             "Initial unique index value is %s. Cannot proceed.", "NULL");
         clean_exit(EXIT_FAILURE);
     }
 
-    readRecCount = PQntuples(readResult);
-    readColCount = PQnfields(readResult);
-
-    if (readRecCount > 1 || readColCount > 1)
+    if (readRecCount > 1)
     {
         LOGSTDERR(ERROR, PQresStatus(PQresultStatus(readResult)),
-            "Initial unique index value query returned too many rows (%d) or columns (%d)",
-                readRecCount, readColCount);
+            "Initial unique index value query returned too many rows (%d)",
+                readRecCount);
         clean_exit(EXIT_FAILURE);
     }
 
-    uniqueKeyValues = strdup(PQgetvalue(readResult, 0, 0));
+    uniqueKeyValues = strdup(PQgetvalue(readResult, row, col));
+    setUniqueKeyTuple(key, readResult, row, 1, readColCount - 1);
 
     PQclear(readResult);
 
@@ -594,8 +879,38 @@ char* getInitUniqueKeyValues(const char* schema, const char* table,
     return uniqueKeyValues;
 }
 
-char* getNextUniqueKeyValues(const char* schema, const char* table,
-                             const char* uniqueKeyCols, const char* prevUkValues)
+void prepareNextUniqueKeyQuery(const char* fullTableName,
+                               const char* uniqueKeyCols,
+                               const char* ukValuesExpr,
+                               const char* ukParamList,
+                               int ukColCount,
+                               const char* filter)
+{
+    // get next lowest unique index value
+    // the previous key is bound as typed parameters, so the row value
+    // comparison is an index range scan that stops at the first row,
+    // or the first row passing the filter.  the key columns are cast to
+    // text so the whole result can be read in binary format
+    char* ukTextCols = constructUkTextCols(uniqueKeyCols);
+
+    const char nextUkValsSql[] =
+        "select %s, %s"
+        "  from %s"
+        " where (%s) > (%s)%s%s"
+        " order by %s"
+        " limit 1;";
+
+    pq_vaprepare(readCxn, NEXT_KEY_STMT_NAME, ukColCount, nextUkValsSql,
+                 ukValuesExpr, ukTextCols,
+                 fullTableName,
+                 uniqueKeyCols, ukParamList,
+                 (filter ? " and " : ""), (filter ? filter : ""),
+                 uniqueKeyCols);
+
+    free((void *) ukTextCols);
+}
+
+char* getNextUniqueKeyValues(Vector* key)
 {
     // query results
     PGresult* readResult = NULL;
@@ -610,39 +925,28 @@ char* getNextUniqueKeyValues(const char* schema, const char* table,
 
     char* uniqueKeyValues = NULL;
 
-    char *escapedUkValues = pq_escape(readCxn, prevUkValues, strlen(prevUkValues));
-
-    // get next lowest unique index value
-    // unique key values is escaped, so don't need E'...' syntax
-    const char nextUkValsSql[] =
-        "select out_cast_next_uk_values"
-        "  from public.get_next_shortest_unique_key_values('%s', '%s', %s);";
-
-    readResult = pq_vaquery(readCxn, nextUkValsSql,
-                        schema, table,
-                        escapedUkValues);
-
-    PQfreemem((void *) escapedUkValues);
+    readResult = pq_execprepared(readCxn, NEXT_KEY_STMT_NAME,
+                        key->size, (const char* const*) key->data,
+                        BINARY_RESULTS);
 
     if (PQresultStatus(readResult) != PGRES_TUPLES_OK)
     {
         LOGSTDERR(ERROR, PQerrorMessage(readCxn),
-            "Next lowest unique index value query failed: %s", nextUkValsSql);
+            "Next lowest unique index value query failed: %s", NEXT_KEY_STMT_NAME);
         clean_exit(EXIT_FAILURE);
     }
-
     readRecCount = PQntuples(readResult);
     readColCount = PQnfields(readResult);
 
-    if (readRecCount > 1 || readColCount > 1)
+    if (readRecCount > 1)
     {
         LOGSTDERR(ERROR, PQresStatus(PQresultStatus(readResult)),
-            "Next lowest unique index value query returned too many rows (%d) or columns (%d)",
-                readRecCount, readColCount);
+            "Next lowest unique index value query returned too many rows (%d)",
+                readRecCount);
         clean_exit(EXIT_FAILURE);
     }
 
-    if (PQgetisnull(readResult, row, col))
+    if (readRecCount == 0 || PQgetisnull(readResult, row, col))
     {
         // return NULL if no more unique key values
         PQclear(readResult);
@@ -650,17 +954,47 @@ char* getNextUniqueKeyValues(const char* schema, const char* table,
     }
 
     uniqueKeyValues = strdup(PQgetvalue(readResult, row, col));
+    setUniqueKeyTuple(key, readResult, row, 1, readColCount - 1);
 
     PQclear(readResult);
 
     return uniqueKeyValues;
 }
 
+// number of values transcode() found to be pure ASCII and returned
+// without detecting or converting them
+unsigned long transcodeAsciiValues()
+{
+    return asciiValues;
+}
+
+// number of values transcode() found to be valid UTF-8, but not pure
+// ASCII, and returned without detecting them under --trust-utf8
+unsigned long transcodeUtf8Values()
+{
+    return utf8Values;
+}
+
+// number of values transcode() converted with a generated single byte
+// encoding table rather than ICU's converters
+unsigned long transcodeTableValues()
+{
+    return tableValues;
+}
+
+// detect a value's encoding and convert it to UTF8.  returns the
+// converted value, valid until the next call, or colResult's own value
+// when it is left as it is.  the caller frees neither
 const char* transcode(PGColResult* colResult, const char* hint,
             char** encoding, char** lang, int32_t* confidence,
             char* conversion_ts, size_t conversion_ts_size,
             bool* converted, bool* dropped_bytes)
 {
+    // the caller reuses conversion_ts for each column of a row, so a
+    // value returned before detection, below, is logged without one
+    // rather than with the last converted value's
+    conversion_ts[0] = '\0';
+
     // value is null or empty string nothing to do
     if ((colResult->isnull == true) ||
         (colResult->isnull == false && colResult->length == 0))
@@ -671,27 +1005,50 @@ const char* transcode(PGColResult* colResult, const char* hint,
         *converted = false;
         *dropped_bytes = false;
 
-        return strdup(colResult->value);
+        return colResult->value;
     }
 
-    // ICU status error code
-    UErrorCode uStatus = U_ZERO_ERROR;
+    // 7 bit ASCII is already UTF8, so there's nothing to detect or
+    // convert, unless it has the escape sequences of ISO-2022 text
+    if (isAscii(colResult->value, colResult->length) &&
+        memchr(colResult->value, '\033', colResult->length) == NULL)
+    {
+        *encoding = "US-ASCII";
+        *lang = "";
+        *confidence = 100;
+        *converted = false;
+        *dropped_bytes = false;
+
+        asciiValues++;
 
-    // ICU variables of holding
-    UChar* uBuf = NULL;
-    int32_t uBuf_len = 0;
+        return colResult->value;
+    }
 
-    // dropped bytes going to UTF16?
-    bool dropped_bytes_toU = false;
+    // detection can take valid UTF-8 for a Latin encoding, and it's what
+    // the value ends up as anyway.  ISO-2022 text is valid UTF-8 too
+    if (field.trustUtf8 && isUtf8(colResult->value, colResult->length) &&
+        memchr(colResult->value, '\033', colResult->length) == NULL)
+    {
+        *encoding = "UTF-8";
+        *lang = "";
+        *confidence = 100;
+        *converted = false;
+        *dropped_bytes = false;
 
-    // dropped bytes going to UTF8?
-    bool dropped_bytes_fromU = false;
+        utf8Values++;
+
+        return colResult->value;
+    }
+
+    // ICU status error code
+    UErrorCode uStatus = U_ZERO_ERROR;
 
     // buffer to convert
     const char* buffer = colResult->value;
 
-    // temporary buffer for converted string
-    char* converted_buf = NULL;
+    // converted string, in convert_to_utf8()'s reusable buffer
+    const char* converted_buf = NULL;
+    int32_t converted_buf_len = 0;
 
     // set conversion timestamp
     conversion_ts = currentTimestamp(conversion_ts, conversion_ts_size);
@@ -710,7 +1067,7 @@ const char* transcode(PGColResult* colResult, const char* hint,
         *converted = false;
         *dropped_bytes = false;
 
-        return strdup(buffer);
+        return buffer;
     }
 
     if (field.debug)
@@ -741,34 +1098,21 @@ const char* transcode(PGColResult* colResult, const char* hint,
         *converted = false;
         *dropped_bytes = false;
 
-        return strdup(buffer);
+        return buffer;
     }
     else
     {
-        // UTF8 output can be up to 6 bytes per input byte
-        int32_t converted_buf_len = strlen(buffer) * 6 * sizeof(char);
-        converted_buf = (char *) malloc(converted_buf_len + 1);
-        memset(converted_buf, 0, converted_buf_len + 1);
-
-        // ICU uses UTF16 internally, so need to convert to UTF16 first
-        // then convert to UTF8
-
-        if (U_SUCCESS(uStatus))
-            uStatus = convert_to_unicode(buffer, (const char*) *encoding,
-                &uBuf, (int32_t*) &uBuf_len,
-                field.force, &dropped_bytes_toU, field.debug);
-
-        if (field.debug)
-            LOGSTDERR(DEBUG, u_errorName(uStatus),
-                "ICU conversion to Unicode status: %d\n", uStatus);
-
-        // so far so good. convert from UTF16 to UTF8
-        if (U_SUCCESS(uStatus))
-            uStatus = convert_to_utf8((const UChar*) uBuf, uBuf_len,
-                &converted_buf, (int32_t*) &converted_buf_len,
-                field.force, &dropped_bytes_fromU, field.debug);
-
-        free((void *) uBuf);
+        // single byte encodings with a generated table convert without
+        // ICU; ICU pivots the rest through UTF16, a block at a time, on
+        // the way to UTF8
+        if (convert_sbcs_to_utf8(buffer, colResult->length, (const char*) *encoding,
+                &converted_buf, &converted_buf_len,
+                field.force, dropped_bytes))
+            tableValues++;
+        else if (U_SUCCESS(uStatus))
+            uStatus = convert_to_utf8(buffer, colResult->length, (const char*) *encoding,
+                &converted_buf, &converted_buf_len,
+                field.force, dropped_bytes, field.debug);
 
         if (field.debug)
             LOGSTDERR(DEBUG, u_errorName(uStatus),
@@ -782,10 +1126,9 @@ const char* transcode(PGColResult* colResult, const char* hint,
                     "ICU conversion complete - status: %d\n", uStatus);
 
             *converted = true;
-            *dropped_bytes = (dropped_bytes_toU || dropped_bytes_fromU);
 
             // return converted buffer
-            return (const char*) converted_buf;
+            return converted_buf;
         }
         else
         {
@@ -796,11 +1139,100 @@ const char* transcode(PGColResult* colResult, const char* hint,
             *dropped_bytes = false;
 
             // return original buffer
-            return strdup(buffer);
+            return buffer;
         }
     }
 }
 
+// detect, convert and log each of a row's character-based column values,
+// appending a converted copy of each to newCBColValues, in the same order.
+// the copies are freed when newCBColValues is freed
+void convertCBColValues(const char* uniqueKeyCols,
+                        const char* uniqueKeyValues,
+                        const Vector* cbColValues,
+                        Vector* newCBColValues)
+{
+    // pointer to converted string
+    const char* converted_buffer = NULL;
+
+    // encoding, language & confidence level
+    char *encoding = NULL;
+    char *lang = NULL;
+    int32_t confidence = 0;
+
+    // conversion timestamp
+    char conversion_ts[28] = {0};
+
+    // boolean flags
+    bool converted = false;
+    bool dropped_bytes = false;
+
+    // for loop index
+    int i = 0;
+
+    // detect charset and transcode it
+    for(i = 0; i < cbColValues->size; i++)
+    {
+        // pointers for column result structs
+        PGColResult* colResult = NULL;
+        PGColResult* newColResult = NULL;
+
+        // get the current value for the column
+        colResult = cbColValues->data[i];
+
+        // copy it to the new column result struct and update value and length after conversion
+        // copyColResult allocates memory for newColResult;
+        newColResult = copyColResult(colResult, newColResult);
+
+        // transcode and get converted value
+        converted_buffer = transcode(colResult, field.hint,
+                            &encoding, &lang, &confidence,
+                            conversion_ts, sizeof(conversion_ts),
+                            &converted, &dropped_bytes);
+
+        // save converted value and length in vector; a value left as it
+        // is comes back as colResult's own, and the copy already has it
+        if (converted_buffer != colResult->value)
+            colResultSetValue(newColResult, converted_buffer);
+
+        // clear and populate vector value
+        // for each column
+        ConversionLog* cl = newConversionLog();
+
+        cl = populateConversionLog(
+                cl,
+                colResult,
+                newColResult,
+                uniqueKeyCols,
+                uniqueKeyValues,
+                encoding,
+                lang,
+                confidence,
+                conversion_ts,
+                converted,
+                dropped_bytes);
+
+        // developer log it!
+        printConversionLog(cl);
+
+        // don't need the conversion log anymore
+        freeConversionLog(cl);
+        free((void *) cl);
+
+        vector_append(newCBColValues, (void *) newColResult);
+
+        // encoding, lang and escaped string are
+        // freed by freeConversionLog
+        // reset indicators
+        confidence = 0;
+        converted = false;
+        dropped_bytes = false;
+
+        // converted_buffer belongs to transcode() or colResult
+        colResult = NULL;
+    }
+}
+
 int printConversionLogHeader()
 {
     const char format[] = "%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s\n";
@@ -18,6 +18,23 @@
 #include "convert.h"
 #include "colresult.h"
 
+// names of the statements prepared on the read connection
+#define READ_STMT_NAME      "transcoder_read"
+#define NEXT_KEY_STMT_NAME  "transcoder_next_key"
+#define EXISTS_STMT_NAME    "transcoder_exists"
+
+// row handle used in place of a unique key by --scan=ctid.  xmin is
+// compared as bigint since xid has no btree operators for a row
+// comparison.  a row updated since it was read has a new ctid and xmin,
+// so a write with a stale handle updates nothing.
+#define CTID_KEY_COLS       "ctid, xmin::text::bigint"
+#define CTID_KEY_DATA_TYPES "tid, bigint"
+
+// regular expression matching any character outside 7-bit ASCII, used by
+// --non-ascii-only.  in a SQL_ASCII database each byte is a character,
+// so this matches any byte with the high bit set
+#define NON_ASCII_PATTERN   "[^\\x01-\\x7f]"
+
 typedef struct
 {
     const char* schemaname;
@@ -56,30 +73,84 @@ const char* getShortestUniqueIndex(const char* schema, const char* table,
                                     char** shortestUniqueIndexCols,
                                     char** shortestUniqueIndexDataTypes);
 
-char* getInitUniqueKeyValues(const char* schema, const char* table,
-                             const char* uniqueKeyCols);
+char* constructUkValuesExpr(const char* uniqueKeyCols, const char* uniqueKeyDataTypes);
+
+char* constructUkParamList(const char* uniqueKeyDataTypes);
+
+char* constructUkTextCols(const char* uniqueKeyCols);
+
+void setUniqueKeyTuple(Vector* key, const PGresult* res, int row,
+                       int firstCol, int ncols);
+
+void getUniqueKeyTuple(Vector* key, const char* uniqueKeyValues);
 
-char* getNextUniqueKeyValues(const char* schema, const char* table,
-                          const char* uniqueKeyCols, const char* prevUkValues);
+char* getInitUniqueKeyValues(Vector* key,
+                             const char* fullTableName,
+                             const char* uniqueKeyCols,
+                             const char* ukValuesExpr,
+                             const char* filter);
+
+void prepareNextUniqueKeyQuery(const char* fullTableName,
+                               const char* uniqueKeyCols,
+                               const char* ukValuesExpr,
+                               const char* ukParamList,
+                               int ukColCount,
+                               const char* filter);
+
+char* getNextUniqueKeyValues(Vector* key);
+
+char* constructNonAsciiFilter(const Vector* cbColNames);
+
+unsigned long countVisitedRows(const char* fullTableName,
+                               const char* uniqueKeyCols,
+                               const char* firstKeyValues,
+                               const char* lastKeyValues);
 
 const char* constructReadQuery(const Vector* cbColNames);
 
+char* constructCBColList(const Vector* cbColNames);
+
+PGresult* describeCBCols(const Vector* cbColNames, const char* fullTableName);
+
+void appendCBColResults(Vector* cols, const PGresult* res, int row, int firstCol,
+                        const PGresult* cbColFields);
+
 void getCBColNames(Vector *cn, const char* schema, const char* table);
-void getCBColValues(Vector *cv, const char* readQuery,
-                       const char* fullTableName,
-                       const char* uniqueKeyCols,
-                       const char* uniqueKeyValues);
+void prepareReadQuery(const char* readQuery,
+                      const char* fullTableName,
+                      const char* uniqueKeyCols,
+                      const char* ukParamList,
+                      int ukColCount);
+
+bool rowExists(const Vector* key, const char* uniqueKeyValues);
+
+void getCBColValues(Vector *cv,
+                    char** ctid,
+                    char** xmin,
+                    const Vector* key,
+                    const char* uniqueKeyValues,
+                    const PGresult* cbColFields);
+
+int colResultWriteLength(const PGColResult* colResult);
 
-char* constructWriteQuery(const char* fullTableName,
-                     const Vector* colValues,
-                     const char* uniqueKeyCols,
-                     const char* uniqueKeyValues);
+char* quoteColResult(const PGColResult* colResult);
+
+unsigned long transcodeAsciiValues();
+
+unsigned long transcodeUtf8Values();
+
+unsigned long transcodeTableValues();
 
 const char* transcode(PGColResult* colResult, const char* hint,
          char** encoding, char** lang, int32_t* confidence,
          char* conversion_ts, size_t conversion_ts_size,
          bool* converted, bool* dropped_bytes);
 
+void convertCBColValues(const char* uniqueKeyCols,
+                        const char* uniqueKeyValues,
+                        const Vector* cbColValues,
+                        Vector* newCBColValues);
+
 int printConversionLogHeader();
 
 int printConversionLog(const ConversionLog* cl);
@@ -0,0 +1,370 @@
+/*
+ * validate.c
+ *
+ * Byte scans that prove a value needs no transcoding, vectorized where
+ * the CPU allows and picked at runtime
+ *
+ * Copyright © 2015, AWeber Communications.
+ * All rights reserved.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "validate.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define VALIDATE_X86 1
+#include <immintrin.h>
+#endif
+
+typedef bool (*ScanFn)(const unsigned char* p, size_t length);
+
+// errors a pair of bytes can show, after simdutf's lookup algorithm: the
+// bits of the three tables below, indexed by the high and low nibbles of
+// the first byte and the high nibble of the second, that are set in all
+// three name the errors the pair makes.  see Keiser and Lemire,
+// "Validating UTF-8 In Less Than One Instruction Per Byte"
+#define UTF8_TOO_SHORT      (1 << 0)    // lead byte not followed by a continuation byte
+#define UTF8_TOO_LONG       (1 << 1)    // ASCII followed by a continuation byte
+#define UTF8_OVERLONG_3     (1 << 2)    // three byte sequence that fits in two
+#define UTF8_TOO_LARGE      (1 << 3)    // above U+10FFFF
+#define UTF8_SURROGATE      (1 << 4)    // U+D800 to U+DFFF
+#define UTF8_OVERLONG_2     (1 << 5)    // two byte sequence that fits in one
+#define UTF8_TOO_LARGE_1000 (1 << 6)    // above U+10FFFF, from the second byte
+#define UTF8_OVERLONG_4     (1 << 6)    // four byte sequence that fits in three
+#define UTF8_TWO_CONTS      (1 << 7)    // two continuation bytes, checked against the lead's length
+#define UTF8_CARRY          (UTF8_TOO_SHORT | UTF8_TOO_LONG | UTF8_TWO_CONTS)
+
+// indexed by the first byte's high nibble
+static const uint8_t utf8Byte1High[16] =
+{
+    // 0xxx: ASCII
+    UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+    UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+    // 10xx: continuation
+    UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS,
+    // 1100, 1101: two byte lead
+    UTF8_TOO_SHORT | UTF8_OVERLONG_2,
+    UTF8_TOO_SHORT,
+    // 1110: three byte lead
+    UTF8_TOO_SHORT | UTF8_OVERLONG_3 | UTF8_SURROGATE,
+    // 1111: four byte lead
+    UTF8_TOO_SHORT | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4
+};
+
+// indexed by the first byte's low nibble
+static const uint8_t utf8Byte1Low[16] =
+{
+    UTF8_CARRY | UTF8_OVERLONG_3 | UTF8_OVERLONG_2 | UTF8_OVERLONG_4,
+    UTF8_CARRY | UTF8_OVERLONG_2,
+    UTF8_CARRY,
+    UTF8_CARRY,
+    UTF8_CARRY | UTF8_TOO_LARGE,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_SURROGATE,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000
+};
+
+// indexed by the second byte's high nibble
+static const uint8_t utf8Byte2High[16] =
+{
+    // 0xxx: ASCII
+    UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+    UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+    // 1000, 1001, 101x: continuation
+    UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4,
+    UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 | UTF8_TOO_LARGE,
+    UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE | UTF8_TOO_LARGE,
+    UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE | UTF8_TOO_LARGE,
+    // 11xx: lead
+    UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT
+};
+
+// scalar fallback: OR the bytes together a word at a time, and look at
+// the high bits once
+static bool isAsciiScalar(const unsigned char* p, size_t length)
+{
+    uint64_t acc = 0;
+    uint64_t word = 0;
+    size_t i = 0;
+
+    for (; i + sizeof(word) <= length; i += sizeof(word))
+    {
+        memcpy(&word, p + i, sizeof(word));
+        acc |= word;
+    }
+
+    for (; i < length; i++)
+        acc |= p[i];
+
+    return (acc & UINT64_C(0x8080808080808080)) == 0;
+}
+
+// scalar fallback: walk the sequences, checking each against the well
+// formed byte ranges of the Unicode standard's table 3-7
+static bool isUtf8Scalar(const unsigned char* p, size_t length)
+{
+    unsigned char lo = 0;
+    unsigned char hi = 0;
+    size_t n = 0;
+    size_t i = 0;
+    size_t k = 0;
+
+    while (i < length)
+    {
+        if (p[i] < 0x80)
+        {
+            i++;
+            continue;
+        }
+
+        // sequence length, and the range of its second byte
+        if (p[i] >= 0xC2 && p[i] <= 0xDF)
+            n = 2, lo = 0x80, hi = 0xBF;
+        else if (p[i] == 0xE0)
+            n = 3, lo = 0xA0, hi = 0xBF;
+        else if (p[i] == 0xED)
+            n = 3, lo = 0x80, hi = 0x9F;
+        else if (p[i] >= 0xE1 && p[i] <= 0xEF)
+            n = 3, lo = 0x80, hi = 0xBF;
+        else if (p[i] == 0xF0)
+            n = 4, lo = 0x90, hi = 0xBF;
+        else if (p[i] >= 0xF1 && p[i] <= 0xF3)
+            n = 4, lo = 0x80, hi = 0xBF;
+        else if (p[i] == 0xF4)
+            n = 4, lo = 0x80, hi = 0x8F;
+        else
+            return false;
+
+        if (length - i < n || p[i + 1] < lo || p[i + 1] > hi)
+            return false;
+
+        for (k = 2; k < n; k++)
+            if ((p[i + k] & 0xC0) != 0x80)
+                return false;
+
+        i += n;
+    }
+
+    return true;
+}
+
+#ifdef VALIDATE_X86
+__attribute__((target("sse2")))
+static bool isAsciiSSE2(const unsigned char* p, size_t length)
+{
+    __m128i acc = _mm_setzero_si128();
+    size_t i = 0;
+
+    for (; i + 16 <= length; i += 16)
+        acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i*) (p + i)));
+
+    // a byte's high bit is set if it isn't ASCII
+    if (_mm_movemask_epi8(acc) != 0)
+        return false;
+
+    return isAsciiScalar(p + i, length - i);
+}
+
+__attribute__((target("avx2")))
+static bool isAsciiAVX2(const unsigned char* p, size_t length)
+{
+    __m256i acc = _mm256_setzero_si256();
+    size_t i = 0;
+
+    for (; i + 32 <= length; i += 32)
+        acc = _mm256_or_si256(acc, _mm256_loadu_si256((const __m256i*) (p + i)));
+
+    if (_mm256_movemask_epi8(acc) != 0)
+        return false;
+
+    return isAsciiSSE2(p + i, length - i);
+}
+
+// errors in a block of 16 bytes, given the block before it: the pairs of
+// each byte and the one before it looked up in the tables, and the third
+// and fourth bytes of three and four byte sequences, which the tables
+// see as stray continuations, checked against the lead two and three
+// bytes back.  zero if the block is valid so far
+__attribute__((target("ssse3")))
+static __m128i utf8ErrorsSSSE3(__m128i input, __m128i prev)
+{
+    const __m128i nibble = _mm_set1_epi8(0x0F);
+    const __m128i byte1High = _mm_loadu_si128((const __m128i*) utf8Byte1High);
+    const __m128i byte1Low  = _mm_loadu_si128((const __m128i*) utf8Byte1Low);
+    const __m128i byte2High = _mm_loadu_si128((const __m128i*) utf8Byte2High);
+
+    __m128i prev1 = _mm_alignr_epi8(input, prev, 15);
+    __m128i prev2 = _mm_alignr_epi8(input, prev, 14);
+    __m128i prev3 = _mm_alignr_epi8(input, prev, 13);
+    __m128i special = _mm_and_si128(
+        _mm_and_si128(
+            _mm_shuffle_epi8(byte1High, _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble)),
+            _mm_shuffle_epi8(byte1Low, _mm_and_si128(prev1, nibble))),
+        _mm_shuffle_epi8(byte2High, _mm_and_si128(_mm_srli_epi16(input, 4), nibble)));
+
+    // 0x80 and above only after a three byte lead two back, 111xxxxx, or
+    // a four byte lead three back, 1111xxxx
+    __m128i mustContinue = _mm_or_si128(_mm_subs_epu8(prev2, _mm_set1_epi8(0xE0 - 0x80)),
+                                        _mm_subs_epu8(prev3, _mm_set1_epi8(0xF0 - 0x80)));
+
+    return _mm_xor_si128(_mm_and_si128(mustContinue, _mm_set1_epi8((char) 0x80)), special);
+}
+
+__attribute__((target("ssse3")))
+static bool isUtf8SSSE3(const unsigned char* p, size_t length)
+{
+    unsigned char tail[16];
+    __m128i input;
+    __m128i prev = _mm_setzero_si128();
+    __m128i errors = _mm_setzero_si128();
+    size_t i = 0;
+
+    for (; i + 16 <= length; i += 16)
+    {
+        input = _mm_loadu_si128((const __m128i*) (p + i));
+        errors = _mm_or_si128(errors, utf8ErrorsSSSE3(input, prev));
+        prev = input;
+    }
+
+    // pad the last bytes with NULs, which are ASCII
+    if (i < length)
+    {
+        memset(tail, 0, sizeof(tail));
+        memcpy(tail, p + i, length - i);
+
+        input = _mm_loadu_si128((const __m128i*) tail);
+        errors = _mm_or_si128(errors, utf8ErrorsSSSE3(input, prev));
+        prev = input;
+    }
+
+    // a sequence cut short by the end of the buffer is followed by NULs
+    errors = _mm_or_si128(errors, utf8ErrorsSSSE3(_mm_setzero_si128(), prev));
+
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(errors, _mm_setzero_si128())) == 0xFFFF;
+}
+
+// utf8ErrorsSSSE3() for 32 bytes.  shuffles and byte shifts work on each
+// 16 byte lane on its own, so the tables are in both lanes, and the bytes
+// before each lane are lined up with a cross-lane permute
+__attribute__((target("avx2")))
+static __m256i utf8ErrorsAVX2(__m256i input, __m256i prev)
+{
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+    const __m256i byte1High = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*) utf8Byte1High));
+    const __m256i byte1Low  = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*) utf8Byte1Low));
+    const __m256i byte2High = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*) utf8Byte2High));
+
+    // the previous block's high lane, then this block's low lane
+    __m256i before = _mm256_permute2x128_si256(prev, input, 0x21);
+    __m256i prev1 = _mm256_alignr_epi8(input, before, 15);
+    __m256i prev2 = _mm256_alignr_epi8(input, before, 14);
+    __m256i prev3 = _mm256_alignr_epi8(input, before, 13);
+    __m256i special = _mm256_and_si256(
+        _mm256_and_si256(
+            _mm256_shuffle_epi8(byte1High, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble)),
+            _mm256_shuffle_epi8(byte1Low, _mm256_and_si256(prev1, nibble))),
+        _mm256_shuffle_epi8(byte2High, _mm256_and_si256(_mm256_srli_epi16(input, 4), nibble)));
+
+    __m256i mustContinue = _mm256_or_si256(_mm256_subs_epu8(prev2, _mm256_set1_epi8(0xE0 - 0x80)),
+                                           _mm256_subs_epu8(prev3, _mm256_set1_epi8(0xF0 - 0x80)));
+
+    return _mm256_xor_si256(_mm256_and_si256(mustContinue, _mm256_set1_epi8((char) 0x80)), special);
+}
+
+__attribute__((target("avx2")))
+static bool isUtf8AVX2(const unsigned char* p, size_t length)
+{
+    unsigned char tail[32];
+    __m256i input;
+    __m256i prev = _mm256_setzero_si256();
+    __m256i errors = _mm256_setzero_si256();
+    size_t i = 0;
+
+    for (; i + 32 <= length; i += 32)
+    {
+        input = _mm256_loadu_si256((const __m256i*) (p + i));
+        errors = _mm256_or_si256(errors, utf8ErrorsAVX2(input, prev));
+        prev = input;
+    }
+
+    if (i < length)
+    {
+        memset(tail, 0, sizeof(tail));
+        memcpy(tail, p + i, length - i);
+
+        input = _mm256_loadu_si256((const __m256i*) tail);
+        errors = _mm256_or_si256(errors, utf8ErrorsAVX2(input, prev));
+        prev = input;
+    }
+
+    errors = _mm256_or_si256(errors, utf8ErrorsAVX2(_mm256_setzero_si256(), prev));
+
+    return _mm256_testz_si256(errors, errors) != 0;
+}
+#endif
+
+// the widest scan this CPU runs
+static ScanFn pickIsAscii(void)
+{
+#ifdef VALIDATE_X86
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2"))
+        return isAsciiAVX2;
+
+    if (__builtin_cpu_supports("sse2"))
+        return isAsciiSSE2;
+#endif
+
+    return isAsciiScalar;
+}
+
+// the widest UTF-8 validator this CPU runs
+static ScanFn pickIsUtf8(void)
+{
+#ifdef VALIDATE_X86
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2"))
+        return isUtf8AVX2;
+
+    if (__builtin_cpu_supports("ssse3"))
+        return isUtf8SSSE3;
+#endif
+
+    return isUtf8Scalar;
+}
+
+// true if no byte of the buffer has its high bit set, i.e. it's 7 bit
+// ASCII, and so already valid UTF-8
+bool isAscii(const char* buffer, size_t length)
+{
+    static ScanFn scan = NULL;
+
+    if (scan == NULL)
+        scan = pickIsAscii();
+
+    return scan((const unsigned char*) buffer, length);
+}
+
+// true if the buffer is well formed UTF-8: no overlong forms, surrogates,
+// code points above U+10FFFF, or stray or missing continuation bytes
+bool isUtf8(const char* buffer, size_t length)
+{
+    static ScanFn scan = NULL;
+
+    if (scan == NULL)
+        scan = pickIsUtf8();
+
+    return scan((const unsigned char*) buffer, length);
+}
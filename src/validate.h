@@ -0,0 +1,21 @@
+/*
+ * validate.h
+ *
+ * Byte scans that prove a value needs no transcoding, vectorized where
+ * the CPU allows and picked at runtime
+ *
+ * Copyright © 2015, AWeber Communications.
+ * All rights reserved.
+ */
+
+#ifndef _VALIDATE_H_
+#define _VALIDATE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+bool isAscii(const char* buffer, size_t length);
+
+bool isUtf8(const char* buffer, size_t length);
+
+#endif // #ifndef _VALIDATE_H_
@@ -81,10 +81,14 @@ void vector_clear(Vector *vector)
         {
             if (strcmp(vector->type, "PGColResult*") == 0)
                 freeColResult(vector->data[index]);
+            else if (strcmp(vector->type, "PGRowResult*") == 0)
+                freeRowResult(vector->data[index]);
             else
                 free(vector->data[index]);
 
             vector->data[index] = NULL;
         }
     }
+
+    vector->size = 0;
 }
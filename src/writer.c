@@ -0,0 +1,1512 @@
+/*
+ * writer.c
+ *
+ * Row writers that send the converted character-based column values
+ * of many rows per update statement, or copy them into a staging table
+ *
+ * Copyright © 2015, AWeber Communications.
+ * All rights reserved.
+ */
+
+// pick up vasprintf
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "writer.h"
+#include "transcoder.h"
+#include "transcoder-utils.h"
+#include "log.h"
+
+// append str to the growing string *sql, see appendBytes()
+static void appendSql(char** sql, size_t* len, size_t* cap, const char* str)
+{
+    appendBytes(sql, len, cap, str, strlen(str));
+}
+
+// true if writes go through explicit transactions: always for
+// --write=copy, and for updates under --commit-every or --commit-interval
+static bool useWriteTransactions(const RowWriter* rw)
+{
+    return (rw->write == WRITE_COPY || rw->commitEvery > 0 || rw->commitInterval > 0);
+}
+
+// roll back the open write transaction when it can't go on.  rows
+// written earlier in the transaction are lost with it, so they are
+// counted as failed; --restart the run to write them again
+static void rollbackWrites(RowWriter* rw)
+{
+    PGresult *writeResult = NULL;
+
+    if (!rw->inTransaction)
+        return;
+
+    writeResult = pq_query(rw->cxn, "rollback;");
+    PQclear(writeResult);
+
+    if (rw->uncommitted > 0)
+    {
+        LOGSTDERR(ERROR, "ROLLBACK",
+            "%lu rows of %s written earlier in the transaction were rolled back",
+            rw->uncommitted, rw->fullTableName);
+
+        rw->rowsUpdated -= rw->uncommitted;
+        rw->rowsFailed  += rw->uncommitted;
+    }
+
+    rw->inTransaction   = false;
+    rw->rowsSinceCommit = 0;
+    rw->uncommitted     = 0;
+}
+
+// end the open write transaction, if any.  rows counted as updated in a
+// transaction that fails to commit are counted as failed instead
+static void commitWrites(RowWriter* rw)
+{
+    PGresult *writeResult = NULL;
+
+    if (!rw->inTransaction)
+        return;
+
+    writeResult = pq_query(rw->cxn, "commit;");
+
+    if (PQresultStatus(writeResult) != PGRES_COMMAND_OK)
+    {
+        LOGSTDERR(ERROR, PQerrorMessage(rw->cxn),
+            "Commit of %lu rows of %s failed", rw->rowsSinceCommit, rw->fullTableName);
+
+        rw->rowsUpdated -= rw->uncommitted;
+        rw->rowsFailed  += rw->uncommitted;
+    }
+
+    PQclear(writeResult);
+
+    rw->inTransaction   = false;
+    rw->rowsSinceCommit = 0;
+    rw->uncommitted     = 0;
+}
+
+// true if the open transaction has written --commit-every rows or been
+// open for --commit-interval milliseconds.  with neither, every update
+// statement or staging flush is committed on its own
+static bool commitDue(const RowWriter* rw)
+{
+    struct timeval now, elapsed;
+
+    if (!rw->inTransaction)
+        return false;
+
+    if (rw->commitEvery == 0 && rw->commitInterval == 0)
+        return true;
+
+    if (rw->commitEvery > 0 && rw->rowsSinceCommit >= rw->commitEvery)
+        return true;
+
+    if (rw->commitInterval > 0)
+    {
+        gettimeofday(&now, NULL);
+        timersub(&now, &rw->txnStart, &elapsed);
+
+        if ((unsigned long) (elapsed.tv_sec * 1000 + elapsed.tv_usec / 1000) >= rw->commitInterval)
+            return true;
+    }
+
+    return false;
+}
+
+// start an update statement or staging flush: open the write transaction
+// if there isn't one, and set a savepoint so a failure only undoes this
+// write instead of the whole transaction
+static void beginWrite(RowWriter* rw)
+{
+    PGresult *writeResult = NULL;
+
+    if (!useWriteTransactions(rw))
+        return;
+
+    if (!rw->inTransaction)
+    {
+        writeResult = pq_query(rw->cxn, "begin;");
+
+        if (PQresultStatus(writeResult) != PGRES_COMMAND_OK)
+        {
+            LOGSTDERR(ERROR, PQerrorMessage(rw->cxn),
+                "Cannot begin write transaction on %s", rw->fullTableName);
+            clean_exit(EXIT_FAILURE);
+        }
+
+        PQclear(writeResult);
+
+        rw->inTransaction = true;
+        gettimeofday(&rw->txnStart, NULL);
+    }
+
+    writeResult = pq_query(rw->cxn, "savepoint " WRITER_SAVEPOINT ";");
+
+    if (PQresultStatus(writeResult) != PGRES_COMMAND_OK)
+    {
+        LOGSTDERR(ERROR, PQerrorMessage(rw->cxn),
+            "Cannot set savepoint in write transaction on %s", rw->fullTableName);
+        clean_exit(EXIT_FAILURE);
+    }
+
+    PQclear(writeResult);
+}
+
+// end a write started with beginWrite(): release its savepoint, or roll
+// back to it if the write failed, keeping the rest of the transaction
+static void endWrite(RowWriter* rw, bool ok)
+{
+    PGresult *writeResult = NULL;
+
+    if (!rw->inTransaction)
+        return;
+
+    writeResult = pq_query(rw->cxn, (ok ? "release savepoint " WRITER_SAVEPOINT ";"
+                                        : "rollback to savepoint " WRITER_SAVEPOINT ";"));
+
+    if (PQresultStatus(writeResult) != PGRES_COMMAND_OK)
+    {
+        LOGSTDERR(ERROR, PQerrorMessage(rw->cxn),
+            "Cannot %s savepoint in write transaction on %s",
+            (ok ? "release" : "roll back to"), rw->fullTableName);
+        rollbackWrites(rw);
+    }
+
+    PQclear(writeResult);
+}
+
+// count a row as updated, and as uncommitted inside a write transaction
+static void countUpdated(RowWriter* rw)
+{
+    rw->rowsUpdated++;
+
+    if (rw->inTransaction)
+        rw->uncommitted++;
+}
+
+// count the rows of a finished update statement or staging flush towards
+// --commit-every, and commit if it's due
+static void wroteRows(RowWriter* rw, unsigned long rows)
+{
+    if (!rw->inTransaction)
+        return;
+
+    rw->rowsSinceCommit += rows;
+
+    if (commitDue(rw))
+        commitWrites(rw);
+}
+
+// a row waiting to be written, with copies of its key, the ctid and
+// xmin it was read with and the key to re-read it by under --scan=ctid;
+// cols is initialized empty
+static PGRowResult* newRowResult(const char* uniqueKeyValues, const Vector* ukTuple,
+                                 const char* ctid, const char* xmin,
+                                 const char* rereadKey)
+{
+    PGRowResult* rowResult = malloc(sizeof(PGRowResult));
+    int i = 0;
+
+    rowResult->ukValues = strdup(uniqueKeyValues);
+    rowResult->ctid = (ctid ? strdup(ctid) : NULL);
+    rowResult->xmin = (xmin ? strdup(xmin) : NULL);
+    rowResult->rereadKey = (rereadKey ? strdup(rereadKey) : NULL);
+
+    vector_init(&rowResult->ukTuple, "char*", (ukTuple ? ukTuple->size : 0));
+
+    for (i = 0; ukTuple && i < ukTuple->size; i++)
+        vector_append(&rowResult->ukTuple,
+            (ukTuple->data[i] ? (void *) strdup(ukTuple->data[i]) : NULL));
+
+    vector_init(&rowResult->cols, "PGColResult*", 0);
+
+    // free in caller
+    return rowResult;
+}
+
+// the key column(s) of the rows queued to be re-read: under --scan=ctid
+// the table's unique key, if it has one, otherwise the writer's own
+static const char* queuedKeyCols(const RowWriter* rw)
+{
+    return (rw->rereadKeyCols ? rw->rereadKeyCols : rw->uniqueKeyCols);
+}
+
+// queue a row's key to be re-read, converted and written again once the
+// table has been walked, see rowWriterTakeConflicts().  ukTuple may be
+// NULL, for the caller to fill in from the key values when it re-reads
+static void deferRow(RowWriter* rw, const char* uniqueKeyValues, const Vector* ukTuple,
+                     const char* reason)
+{
+    LOGSTDOUT(INFO, "DEFERRED",
+        "%s.%s, %s=%s %s; queued to be re-read.\n",
+        field.schema, field.table, queuedKeyCols(rw), uniqueKeyValues, reason);
+
+    vector_append(&rw->conflicts,
+        (void *) newRowResult(uniqueKeyValues, ukTuple, NULL, NULL, NULL));
+}
+
+// queue a row the writer couldn't write to be re-read.  under
+// --scan=ctid it's re-read by the table's unique key, since its ctid
+// and xmin change when anyone updates it
+static void rereadRow(RowWriter* rw, const PGRowResult* row, const char* reason)
+{
+    if (row->rereadKey)
+        deferRow(rw, row->rereadKey, NULL, reason);
+    else
+        deferRow(rw, row->ukValues, &row->ukTuple, reason);
+}
+
+// a row an update didn't find was deleted, or for --scan=ctid or
+// --optimistic changed, since it was read.  under --optimistic, or
+// --scan=ctid on a table with a unique key, it's queued to be re-read,
+// see rowWriterTakeConflicts().  otherwise a --scan=ctid row can't be
+// found again, so it fails the run
+static void notUpdated(RowWriter* rw, const PGRowResult* row, ExecStatusType status)
+{
+    if (rw->optimistic || row->rereadKey)
+    {
+        rereadRow(rw, row, "changed since it was read");
+    }
+    else if (rw->ctidKeyed)
+    {
+        LOGSTDOUT(ERROR, PQresStatus(status),
+            "%s.%s, %s=%s changed or was deleted since it was read; not updated.\n",
+            field.schema, field.table, rw->uniqueKeyCols, row->ukValues);
+
+        rw->rowsFailed++;
+    }
+    else
+    {
+        LOGSTDOUT(WARNING, PQresStatus(status),
+            "%s.%s, %s=%s changed since it was read; not updated.\n",
+            field.schema, field.table, rw->uniqueKeyCols, row->ukValues);
+    }
+}
+
+// true if a write failed because it waited too long for a lock, under
+// --lock-timeout, ran longer than --statement-timeout, or was picked to
+// break a deadlock.  rows it was writing are worth trying again later
+static bool isLockTimeout(const PGresult* writeResult)
+{
+    const char* sqlstate = PQresultErrorField(writeResult, PG_DIAG_SQLSTATE);
+
+    return (sqlstate != NULL &&
+            (strcmp(sqlstate, "55P03") == 0 ||    // lock_not_available
+             strcmp(sqlstate, "57014") == 0 ||    // query_canceled
+             strcmp(sqlstate, "40P01") == 0));    // deadlock_detected
+}
+
+// block and offset of a ctid given as text, e.g. (12,3).  returns false
+// if it isn't one
+static bool parseCtid(const char* ctid, unsigned long* block, unsigned long* offset)
+{
+    return (ctid != NULL && sscanf(ctid, "(%lu,%lu)", block, offset) == 2);
+}
+
+// qsort comparison of two PGRowResult* by the heap block and offset they
+// were read from.  rows without a ctid go last
+static int compareRowCtids(const void* a, const void* b)
+{
+    const PGRowResult* ra = *(const PGRowResult* const*) a;
+    const PGRowResult* rb = *(const PGRowResult* const*) b;
+    unsigned long blockA = 0, offsetA = 0;
+    unsigned long blockB = 0, offsetB = 0;
+    bool hasA = parseCtid(ra->ctid, &blockA, &offsetA);
+    bool hasB = parseCtid(rb->ctid, &blockB, &offsetB);
+
+    if (hasA != hasB)
+        return (hasA ? -1 : 1);
+
+    if (blockA != blockB)
+        return (blockA < blockB ? -1 : 1);
+
+    if (offsetA != offsetB)
+        return (offsetA < offsetB ? -1 : 1);
+
+    return 0;
+}
+
+// put rows waiting to be written in the physical order they were read
+// from, so a batch updates its heap pages in order rather than at random
+// when the rows were read in unique key order, and log how many pages
+// it touches
+static void sortRowsByCtid(const RowWriter* rw, Vector* rows)
+{
+    unsigned long block = 0, offset = 0;
+    unsigned long lastBlock = 0;
+    unsigned long pages = 0;
+    int row = 0;
+
+    if (rows->size == 0)
+        return;
+
+    qsort(rows->data, rows->size, sizeof(void*), compareRowCtids);
+
+    for (row = 0; row < rows->size; row++)
+    {
+        if (!parseCtid(((PGRowResult*) rows->data[row])->ctid, &block, &offset))
+            continue;
+
+        if (pages == 0 || block != lastBlock)
+            pages++;
+
+        lastBlock = block;
+    }
+
+    LOGSTDERR(INFO, "HEAP_PAGES",
+        "Writing %d %s of %s touching %lu heap %s",
+        rows->size, (rows->size == 1 ? "row" : "rows"), rw->fullTableName,
+        pages, (pages == 1 ? "page" : "pages"));
+}
+
+// comma separated names of the columns a row sets, which identifies
+// both its batch and its prepared update
+static char* constructColSignature(const Vector* cols)
+{
+    char* signature = NULL;
+    char* tmp = NULL;
+    int i = 0;
+
+    signature = calloc(sizeof(char), 1);
+
+    for (i = 0; i < cols->size; i++)
+    {
+        tmp = signature;
+        signature = concat(tmp, (i > 0 ? "," : ""),
+                           ((PGColResult*) cols->data[i])->fname,
+                           (char*) NULL);
+        free((void *) tmp);
+    }
+
+    // free in caller
+    return signature;
+}
+
+// find the update prepared for the set of columns a row sets, or
+// prepare it.  the unique key is bound first, as text parameters cast
+// to the key's types, then the values, as binary text parameters, then
+// under --optimistic the ctid and xmin the row was read with:
+//
+//   "update <table> set <col1> = $<k+1>::text, ..."
+//   " where (<uk cols>) = ($1::<type1>, ...)"
+//   "   and (ctid, xmin::text::bigint) = ($<k+n+1>::tid, $<k+n+2>::bigint);"
+static const WriteStmt* getWriteStmt(RowWriter* rw, const PGRowResult* row)
+{
+    WriteStmt* ws = NULL;
+    char* signature = NULL;
+    char* sql = NULL;
+    size_t len = 0;
+    size_t cap = 0;
+    char* piece = NULL;
+    int i = 0;
+
+    signature = constructColSignature(&row->cols);
+
+    for (i = 0; i < rw->writeStmts.size; i++)
+    {
+        if (strcmp(((WriteStmt*) rw->writeStmts.data[i])->signature, signature) == 0)
+        {
+            free((void *) signature);
+            return rw->writeStmts.data[i];
+        }
+    }
+
+    ws = malloc(sizeof(WriteStmt));
+    ws->signature = signature;
+
+    if (asprintf(&ws->name, WRITE_STMT_PREFIX "%d", rw->writeStmts.size + 1) < 0)
+    {
+        perror("asprintf - write statement name");
+        clean_exit(EXIT_FAILURE);
+    }
+
+    appendSql(&sql, &len, &cap, "update ");
+    appendSql(&sql, &len, &cap, rw->fullTableName);
+    appendSql(&sql, &len, &cap, " set ");
+
+    for (i = 0; i < row->cols.size; i++)
+    {
+        if (asprintf(&piece, "%s%s = $%d::text", (i > 0 ? ", " : ""),
+                     ((PGColResult*) row->cols.data[i])->fname,
+                     rw->keyColCount + i + 1) < 0)
+        {
+            perror("asprintf - write set");
+            clean_exit(EXIT_FAILURE);
+        }
+
+        appendSql(&sql, &len, &cap, piece);
+        free((void *) piece);
+    }
+
+    appendSql(&sql, &len, &cap, " where (");
+    appendSql(&sql, &len, &cap, rw->uniqueKeyCols);
+    appendSql(&sql, &len, &cap, ") = (");
+    appendSql(&sql, &len, &cap, rw->ukParamList);
+    appendSql(&sql, &len, &cap, ")");
+
+    if (rw->optimistic)
+    {
+        if (asprintf(&piece, " and (" CTID_KEY_COLS ") = ($%d::tid, $%d::bigint)",
+                     rw->keyColCount + row->cols.size + 1,
+                     rw->keyColCount + row->cols.size + 2) < 0)
+        {
+            perror("asprintf - write row version");
+            clean_exit(EXIT_FAILURE);
+        }
+
+        appendSql(&sql, &len, &cap, piece);
+        free((void *) piece);
+    }
+
+    appendSql(&sql, &len, &cap, ";");
+
+    // the query is a format string to pq_vaprepare
+    pq_vaprepare(rw->cxn, ws->name,
+                 rw->keyColCount + row->cols.size + (rw->optimistic ? 2 : 0), "%s", sql);
+
+    free((void *) sql);
+
+    vector_append(&rw->writeStmts, (void *) ws);
+
+    return ws;
+}
+
+// bind the parameters of a row's prepared update: the unique key as text,
+// then the converted values as their raw bytes, truncated to fit a
+// varchar(n) or char(n) column, so nothing is escaped or quoted, then
+// under --optimistic the row's ctid and xmin as text.  the arrays are
+// allocated here and freed in the caller
+static int bindRowParams(const RowWriter* rw, const PGRowResult* row,
+                         const char*** values, int** lengths, int** formats)
+{
+    int nParams = rw->keyColCount + row->cols.size + (rw->optimistic ? 2 : 0);
+    int i = 0;
+
+    *values  = calloc(nParams, sizeof(char*));
+    *lengths = calloc(nParams, sizeof(int));
+    *formats = calloc(nParams, sizeof(int));
+
+    // text unique key values; NULL for a missing or NULL key column
+    for (i = 0; i < rw->keyColCount; i++)
+        (*values)[i] = (i < row->ukTuple.size ? row->ukTuple.data[i] : NULL);
+
+    for (i = 0; i < row->cols.size; i++)
+    {
+        const PGColResult* colResult = row->cols.data[i];
+        int param = rw->keyColCount + i;
+
+        (*formats)[param] = BINARY_RESULTS;
+
+        if (!colResult->isnull)
+        {
+            (*values)[param]  = colResult->value;
+            (*lengths)[param] = colResultWriteLength(colResult);
+        }
+    }
+
+    if (rw->optimistic)
+    {
+        (*values)[nParams - 2] = row->ctid;
+        (*values)[nParams - 1] = row->xmin;
+    }
+
+    return nParams;
+}
+
+// log and count the result of a row's update.  returns true if the
+// update ran, whether or not it found the row
+static bool logRowWrite(RowWriter* rw, const PGRowResult* row, const PGresult* writeResult)
+{
+    if (PQresultStatus(writeResult) == PGRES_COMMAND_OK &&
+        atoi(PQcmdTuples((PGresult*) writeResult)) == 0)
+    {
+       notUpdated(rw, row, PQresultStatus(writeResult));
+    }
+    else if (PQresultStatus(writeResult) == PGRES_COMMAND_OK)
+    {
+       // log success on stdout
+       if (field.debug)
+           LOGSTDOUT(DEBUG, PQresStatus(PQresultStatus(writeResult)),
+               "%s.%s, %s=%s updated.\n",
+               field.schema, field.table, rw->uniqueKeyCols, row->ukValues);
+
+       countUpdated(rw);
+    }
+    else if (isLockTimeout(writeResult))
+    {
+       // don't let a row another transaction holds stall the run
+       rereadRow(rw, row, "timed out waiting for a lock");
+    }
+    else
+    {
+       // log failure on stderr
+       LOGSTDOUT(ERROR, PQresStatus(PQresultStatus(writeResult)),
+           "%s.%s, %s=%s update failed.\n",
+           field.schema, field.table, rw->uniqueKeyCols, row->ukValues);
+
+       rw->rowsFailed++;
+    }
+
+    return (PQresultStatus(writeResult) == PGRES_COMMAND_OK);
+}
+
+// write one row with the update prepared for the columns it sets
+static void writeRow(RowWriter* rw, const PGRowResult* row)
+{
+    PGresult *writeResult = NULL;
+    const WriteStmt* ws = NULL;
+    const char** values = NULL;
+    int* lengths = NULL;
+    int* formats = NULL;
+    int nParams = 0;
+
+    ws = getWriteStmt(rw, row);
+
+    beginWrite(rw);
+
+    nParams = bindRowParams(rw, row, &values, &lengths, &formats);
+
+    writeResult = pq_execpreparedparams(rw->cxn, ws->name, nParams,
+                                        values, lengths, formats, TEXT_RESULTS);
+
+    endWrite(rw, logRowWrite(rw, row, writeResult));
+
+    PQclear(writeResult);
+    free((void *) values);
+    free((void *) lengths);
+    free((void *) formats);
+}
+
+// write the rows waiting for the pipeline with their prepared updates,
+// sending them all before reading any result.  each update is followed
+// by its own sync, so it commits on its own, and a failed one doesn't
+// abort the ones after it.  the results come back in order, so they are
+// matched to the rows they were sent for
+static void flushPipeline(RowWriter* rw)
+{
+#ifdef LIBPQ_HAS_PIPELINING
+    PGresult *writeResult = NULL;
+    const char** values = NULL;
+    int* lengths = NULL;
+    int* formats = NULL;
+    int nParams = 0;
+    int sent = 0;
+    int row = 0;
+
+    if (rw->pipelined.size == 0)
+        return;
+
+    sortRowsByCtid(rw, &rw->pipelined);
+
+    // statements can't be prepared synchronously in pipeline mode
+    for (row = 0; row < rw->pipelined.size; row++)
+        getWriteStmt(rw, rw->pipelined.data[row]);
+
+    if (PQenterPipelineMode(rw->cxn) != 1)
+    {
+        LOGSTDERR(WARNING, PQerrorMessage(rw->cxn),
+            "Cannot enter pipeline mode on %s; writing rows one at a time",
+            rw->fullTableName);
+
+        rw->pipelineDepth = 0;
+
+        for (row = 0; row < rw->pipelined.size; row++)
+            writeRow(rw, rw->pipelined.data[row]);
+
+        vector_clear(&rw->pipelined);
+        return;
+    }
+
+    for (sent = 0; sent < rw->pipelined.size; sent++)
+    {
+        const PGRowResult* rowResult = rw->pipelined.data[sent];
+        const WriteStmt* ws = getWriteStmt(rw, rowResult);
+
+        nParams = bindRowParams(rw, rowResult, &values, &lengths, &formats);
+
+        if (PQsendQueryPrepared(rw->cxn, ws->name, nParams, values, lengths,
+                                formats, TEXT_RESULTS) != 1 ||
+            PQpipelineSync(rw->cxn) != 1)
+        {
+            LOGSTDERR(ERROR, PQerrorMessage(rw->cxn),
+                "Cannot send update of %s=%s to the pipeline",
+                rw->uniqueKeyCols, rowResult->ukValues);
+            clean_exit(EXIT_FAILURE);
+        }
+
+        free((void *) values);
+        free((void *) lengths);
+        free((void *) formats);
+    }
+
+    for (row = 0; row < sent; row++)
+    {
+        // the update's result, the end of its results, then its sync
+        writeResult = PQgetResult(rw->cxn);
+        logRowWrite(rw, rw->pipelined.data[row], writeResult);
+        PQclear(writeResult);
+
+        while ((writeResult = PQgetResult(rw->cxn)) != NULL)
+            PQclear(writeResult);
+
+        writeResult = PQgetResult(rw->cxn);
+
+        if (PQresultStatus(writeResult) != PGRES_PIPELINE_SYNC)
+        {
+            LOGSTDERR(ERROR, PQerrorMessage(rw->cxn),
+                "Pipeline on %s lost sync after %s=%s", rw->fullTableName,
+                rw->uniqueKeyCols, ((PGRowResult*) rw->pipelined.data[row])->ukValues);
+            clean_exit(EXIT_FAILURE);
+        }
+
+        PQclear(writeResult);
+    }
+
+    if (PQexitPipelineMode(rw->cxn) != 1)
+        LOGSTDERR(WARNING, PQerrorMessage(rw->cxn),
+            "Cannot leave pipeline mode on %s", rw->fullTableName);
+
+    if (field.debug)
+        LOGSTDERR(DEBUG, PQresStatus(PGRES_PIPELINE_SYNC),
+            "Pipelined %d updates of %s", sent, rw->fullTableName);
+#endif
+
+    vector_clear(&rw->pipelined);
+}
+
+static char* constructBatchWriteQuery(const RowWriter* rw, const WriteBatch* wb)
+{
+/* construct one update statement for the rows of a batch, which all set
+   the same columns
+
+    "update <table>"
+    "   set <col1> = transcoder_v.transcoder_val1, ..."
+    "  from (values (1, <uk values>, <value1>, ...), ...)"
+    "       as transcoder_v (transcoder_row, transcoder_uk1, ..., transcoder_val1, ...)"
+    " where (<uk cols>) = (transcoder_v.transcoder_uk1, ...)"
+    " returning transcoder_v.transcoder_row;"
+
+   the returned row numbers tell which rows were updated.  under
+   --optimistic each row also carries the ctid and xmin it was read with,
+   as transcoder_ctid and transcoder_xmin after the key, and the where
+   clause adds
+
+    "   and (ctid, xmin::text::bigint) = (transcoder_v.transcoder_ctid, transcoder_v.transcoder_xmin)"
+*/
+
+    const PGRowResult* first = wb->rows.data[0];
+    char* sql = NULL;
+    size_t len = 0;
+    size_t cap = 0;
+    char* piece = NULL;
+    char* quotedVal = NULL;
+    int row = 0;
+    int i = 0;
+
+    appendSql(&sql, &len, &cap, "update ");
+    appendSql(&sql, &len, &cap, rw->fullTableName);
+    appendSql(&sql, &len, &cap, " set ");
+
+    for (i = 0; i < first->cols.size; i++)
+    {
+        const PGColResult* colResult = first->cols.data[i];
+
+        if (asprintf(&piece, "%s%s = " WRITER_VALUES_ALIAS "." WRITER_VALUE_COL "%d",
+                     (i > 0 ? ", " : ""), colResult->fname, i + 1) < 0)
+        {
+            perror("asprintf - batch set");
+            clean_exit(EXIT_FAILURE);
+        }
+
+        appendSql(&sql, &len, &cap, piece);
+        free((void *) piece);
+    }
+
+    appendSql(&sql, &len, &cap, " from (values ");
+
+    for (row = 0; row < wb->rows.size; row++)
+    {
+        const PGRowResult* rowResult = wb->rows.data[row];
+
+        if (asprintf(&piece, "%s(%d, %s", (row > 0 ? ", " : ""), row + 1,
+                     rowResult->ukValues) < 0)
+        {
+            perror("asprintf - batch values");
+            clean_exit(EXIT_FAILURE);
+        }
+
+        appendSql(&sql, &len, &cap, piece);
+        free((void *) piece);
+
+        if (rw->optimistic)
+        {
+            // text of a tid and an xid, so nothing to escape
+            if (rowResult->ctid && rowResult->xmin)
+            {
+                if (asprintf(&piece, ", '%s'::tid, '%s'::bigint",
+                             rowResult->ctid, rowResult->xmin) < 0)
+                {
+                    perror("asprintf - batch row version");
+                    clean_exit(EXIT_FAILURE);
+                }
+            }
+            else
+            {
+                piece = strdup(", null::tid, null::bigint");
+            }
+
+            appendSql(&sql, &len, &cap, piece);
+            free((void *) piece);
+        }
+
+        for (i = 0; i < rowResult->cols.size; i++)
+        {
+            quotedVal = quoteColResult(rowResult->cols.data[i]);
+
+            appendSql(&sql, &len, &cap, ", ");
+            appendSql(&sql, &len, &cap, quotedVal);
+
+            free((void *) quotedVal);
+        }
+
+        appendSql(&sql, &len, &cap, ")");
+    }
+
+    appendSql(&sql, &len, &cap, ") as " WRITER_VALUES_ALIAS " (" WRITER_ROW_COL);
+
+    for (i = 0; i < rw->keyColCount; i++)
+    {
+        if (asprintf(&piece, ", " WRITER_KEY_COL "%d", i + 1) < 0)
+        {
+            perror("asprintf - batch key columns");
+            clean_exit(EXIT_FAILURE);
+        }
+
+        appendSql(&sql, &len, &cap, piece);
+        free((void *) piece);
+    }
+
+    if (rw->optimistic)
+        appendSql(&sql, &len, &cap, ", " WRITER_CTID_COL ", " WRITER_XMIN_COL);
+
+    for (i = 0; i < first->cols.size; i++)
+    {
+        if (asprintf(&piece, ", " WRITER_VALUE_COL "%d", i + 1) < 0)
+        {
+            perror("asprintf - batch value columns");
+            clean_exit(EXIT_FAILURE);
+        }
+
+        appendSql(&sql, &len, &cap, piece);
+        free((void *) piece);
+    }
+
+    appendSql(&sql, &len, &cap, ") where (");
+    appendSql(&sql, &len, &cap, rw->uniqueKeyCols);
+    appendSql(&sql, &len, &cap, ") = (");
+
+    for (i = 0; i < rw->keyColCount; i++)
+    {
+        if (asprintf(&piece, "%s" WRITER_VALUES_ALIAS "." WRITER_KEY_COL "%d",
+                     (i > 0 ? ", " : ""), i + 1) < 0)
+        {
+            perror("asprintf - batch where");
+            clean_exit(EXIT_FAILURE);
+        }
+
+        appendSql(&sql, &len, &cap, piece);
+        free((void *) piece);
+    }
+
+    appendSql(&sql, &len, &cap, ")");
+
+    if (rw->optimistic)
+        appendSql(&sql, &len, &cap, " and (" CTID_KEY_COLS ") = ("
+                                    WRITER_VALUES_ALIAS "." WRITER_CTID_COL ", "
+                                    WRITER_VALUES_ALIAS "." WRITER_XMIN_COL ")");
+
+    appendSql(&sql, &len, &cap, " returning " WRITER_VALUES_ALIAS "." WRITER_ROW_COL ";");
+
+    if (field.debug)
+    {
+        fprintf(stderr, "%s\n", sql);
+    }
+
+    // free in caller
+    return sql;
+}
+
+// write the rows of a batch with one update statement.  if the statement
+// fails, write them one at a time so the failure is put on the right row
+static void flushBatch(RowWriter* rw, WriteBatch* wb)
+{
+    PGresult *writeResult = NULL;
+    char* sql = NULL;
+    bool* updated = NULL;
+    int row = 0;
+    int i = 0;
+
+    if (wb->rows.size == 0)
+        return;
+
+    sortRowsByCtid(rw, &wb->rows);
+
+    sql = constructBatchWriteQuery(rw, wb);
+
+    beginWrite(rw);
+
+    writeResult = pq_query(rw->cxn, sql);
+
+    if (PQresultStatus(writeResult) == PGRES_TUPLES_OK)
+    {
+        updated = calloc(wb->rows.size, sizeof(bool));
+
+        // row numbers of the rows updated
+        for (i = 0; i < PQntuples(writeResult); i++)
+        {
+            row = atoi(PQgetvalue(writeResult, i, 0)) - 1;
+
+            if (row >= 0 && row < wb->rows.size)
+                updated[row] = true;
+        }
+
+        for (row = 0; row < wb->rows.size; row++)
+        {
+            const PGRowResult* rowResult = wb->rows.data[row];
+
+            if (updated[row])
+            {
+                if (field.debug)
+                    LOGSTDOUT(DEBUG, PQresStatus(PQresultStatus(writeResult)),
+                        "%s.%s, %s=%s updated.\n",
+                        field.schema, field.table, rw->uniqueKeyCols, rowResult->ukValues);
+
+                countUpdated(rw);
+            }
+            else
+            {
+                notUpdated(rw, rowResult, PQresultStatus(writeResult));
+            }
+        }
+
+        free((void *) updated);
+
+        endWrite(rw, true);
+    }
+    else
+    {
+        LOGSTDERR(WARNING, PQerrorMessage(rw->cxn),
+            "Update of a batch of %d rows of %s failed; writing them one at a time",
+            wb->rows.size, rw->fullTableName);
+
+        endWrite(rw, false);
+
+        for (row = 0; row < wb->rows.size; row++)
+            writeRow(rw, wb->rows.data[row]);
+    }
+
+    wroteRows(rw, wb->rows.size);
+
+    PQclear(writeResult);
+    free((void *) sql);
+
+    // keep the batch for more rows with the same columns
+    vector_clear(&wb->rows);
+}
+
+static char* constructApplyQuery(const RowWriter* rw)
+{
+/* construct the update applying the staged rows to the table.  staged
+   values are only assigned where the row sets them
+
+    "update <table>"
+    "   set <col1> = case when transcoder_v.transcoder_set1"
+    "                     then transcoder_v.transcoder_val1 else <col1> end, ..."
+    "  from (select * from transcoder_staging) as transcoder_v"
+    " where (<uk cols>) = (transcoder_v.transcoder_uk1::<type1>, ...)"
+    " returning transcoder_v.transcoder_row;"
+
+   under --optimistic the where clause adds
+
+    "   and (ctid, xmin::text::bigint)"
+    "     = (transcoder_v.transcoder_ctid::tid, transcoder_v.transcoder_xmin::bigint)"
+
+   the subquery hides the staging table's system columns, which would
+   make ctid and xmin ambiguous for --scan=ctid and --optimistic
+*/
+
+    char* sql = NULL;
+    size_t len = 0;
+    size_t cap = 0;
+    char* piece = NULL;
+    int i = 0;
+
+    appendSql(&sql, &len, &cap, "update ");
+    appendSql(&sql, &len, &cap, rw->fullTableName);
+    appendSql(&sql, &len, &cap, " set ");
+
+    for (i = 0; i < rw->cbColNames->size; i++)
+    {
+        const char* col = rw->cbColNames->data[i];
+
+        if (asprintf(&piece, "%s%s = case when " WRITER_VALUES_ALIAS "." WRITER_SET_COL "%d"
+                     " then " WRITER_VALUES_ALIAS "." WRITER_VALUE_COL "%d else %s end",
+                     (i > 0 ? ", " : ""), col, i + 1, i + 1, col) < 0)
+        {
+            perror("asprintf - apply set");
+            clean_exit(EXIT_FAILURE);
+        }
+
+        appendSql(&sql, &len, &cap, piece);
+        free((void *) piece);
+    }
+
+    appendSql(&sql, &len, &cap, " from (select * from " WRITER_STAGING_TABLE ") as "
+                                WRITER_VALUES_ALIAS " where (");
+    appendSql(&sql, &len, &cap, rw->uniqueKeyCols);
+    appendSql(&sql, &len, &cap, ") = (");
+
+    for (i = 0; i < rw->keyColCount; i++)
+    {
+        if (asprintf(&piece, "%s" WRITER_VALUES_ALIAS "." WRITER_KEY_COL "%d::%s",
+                     (i > 0 ? ", " : ""), i + 1, (const char*) rw->ukTypes.data[i]) < 0)
+        {
+            perror("asprintf - apply where");
+            clean_exit(EXIT_FAILURE);
+        }
+
+        appendSql(&sql, &len, &cap, piece);
+        free((void *) piece);
+    }
+
+    appendSql(&sql, &len, &cap, ")");
+
+    if (rw->optimistic)
+        appendSql(&sql, &len, &cap, " and (" CTID_KEY_COLS ") = ("
+                                    WRITER_VALUES_ALIAS "." WRITER_CTID_COL "::tid, "
+                                    WRITER_VALUES_ALIAS "." WRITER_XMIN_COL "::bigint)");
+
+    appendSql(&sql, &len, &cap, " returning " WRITER_VALUES_ALIAS "." WRITER_ROW_COL ";");
+
+    if (field.debug)
+        LOGSTDERR(DEBUG, "Apply SQL Query", "%s", sql);
+
+    // free in caller
+    return sql;
+}
+
+// create the staging table on the write connection, outside of any write
+// transaction so a rollback doesn't drop it.  every column but the row
+// number is text or boolean, so rows can be copied in binary format
+// straight from the converted values; the key is cast back to its types
+// by the apply query
+static void createStaging(RowWriter* rw)
+{
+    PGresult *writeResult = NULL;
+    char* sql = NULL;
+    size_t len = 0;
+    size_t cap = 0;
+    char* piece = NULL;
+    int i = 0;
+
+    appendSql(&sql, &len, &cap, "create temp table " WRITER_STAGING_TABLE
+                                " (" WRITER_ROW_COL " integer");
+
+    for (i = 0; i < rw->keyColCount; i++)
+    {
+        if (asprintf(&piece, ", " WRITER_KEY_COL "%d text", i + 1) < 0)
+        {
+            perror("asprintf - staging key columns");
+            clean_exit(EXIT_FAILURE);
+        }
+
+        appendSql(&sql, &len, &cap, piece);
+        free((void *) piece);
+    }
+
+    // the row version, checked by the apply query under --optimistic
+    appendSql(&sql, &len, &cap, ", " WRITER_CTID_COL " text, " WRITER_XMIN_COL " text");
+
+    for (i = 0; i < rw->cbColNames->size; i++)
+    {
+        if (asprintf(&piece, ", " WRITER_SET_COL "%d boolean, " WRITER_VALUE_COL "%d text",
+                     i + 1, i + 1) < 0)
+        {
+            perror("asprintf - staging value columns");
+            clean_exit(EXIT_FAILURE);
+        }
+
+        appendSql(&sql, &len, &cap, piece);
+        free((void *) piece);
+    }
+
+    appendSql(&sql, &len, &cap, ");");
+
+    writeResult = pq_query(rw->cxn, sql);
+
+    if (PQresultStatus(writeResult) != PGRES_COMMAND_OK)
+    {
+        LOGSTDERR(ERROR, PQerrorMessage(rw->cxn),
+            "Cannot create staging table: %s", sql);
+        clean_exit(EXIT_FAILURE);
+    }
+
+    PQclear(writeResult);
+    free((void *) sql);
+
+    rw->applyQuery = constructApplyQuery(rw);
+}
+
+// copy the staged rows into the staging table with a binary COPY FROM
+// STDIN, one row per PQputCopyData call.  returns false if the copy failed
+static bool copyStaged(RowWriter* rw)
+{
+    PGresult *writeResult = NULL;
+    char* buf = NULL;
+    size_t len = 0;
+    size_t cap = 0;
+    bool ok = true;
+    int32_t rowNumber = 0;
+    int row = 0;
+    int i = 0;
+    int k = 0;
+
+    writeResult = pq_query(rw->cxn, "copy " WRITER_STAGING_TABLE
+                                    " from stdin with (format binary);");
+
+    if (PQresultStatus(writeResult) != PGRES_COPY_IN)
+    {
+        PQclear(writeResult);
+        return false;
+    }
+
+    PQclear(writeResult);
+
+    // signature, flags and header extension length
+    appendBytes(&buf, &len, &cap, COPY_BINARY_SIGNATURE, COPY_BINARY_SIGNATURE_LEN);
+    appendCopyInt(&buf, &len, &cap, 4, 0);
+    appendCopyInt(&buf, &len, &cap, 4, 0);
+
+    for (row = 0; ok && row < rw->staged.size; row++)
+    {
+        const PGRowResult* rowResult = rw->staged.data[row];
+
+        appendCopyInt(&buf, &len, &cap, 2, 1 + rw->keyColCount + 2 + 2 * rw->cbColNames->size);
+
+        // binary integer, so the row number goes in as its 4 bytes
+        appendCopyInt(&buf, &len, &cap, 4, sizeof(rowNumber));
+        appendCopyInt(&buf, &len, &cap, 4, row + 1);
+
+        for (i = 0; i < rw->keyColCount; i++)
+        {
+            const char* key = (i < rowResult->ukTuple.size ? rowResult->ukTuple.data[i] : NULL);
+
+            appendCopyField(&buf, &len, &cap, key, (key ? strlen(key) : 0));
+        }
+
+        appendCopyField(&buf, &len, &cap, rowResult->ctid,
+                        (rowResult->ctid ? strlen(rowResult->ctid) : 0));
+        appendCopyField(&buf, &len, &cap, rowResult->xmin,
+                        (rowResult->xmin ? strlen(rowResult->xmin) : 0));
+
+        // the row's columns are in table order, but with
+        // --skip-ascii-columns only some of them are there
+        for (i = 0, k = 0; i < rw->cbColNames->size; i++)
+        {
+            const PGColResult* colResult = NULL;
+
+            if (k < rowResult->cols.size &&
+                strcmp(((PGColResult*) rowResult->cols.data[k])->fname,
+                       (const char*) rw->cbColNames->data[i]) == 0)
+                colResult = rowResult->cols.data[k++];
+
+            appendCopyField(&buf, &len, &cap, (colResult ? "\1" : "\0"), 1);
+
+            if (colResult == NULL || colResult->isnull)
+                appendCopyField(&buf, &len, &cap, NULL, 0);
+            else
+                appendCopyField(&buf, &len, &cap, colResult->value,
+                                colResultWriteLength(colResult));
+        }
+
+        ok = (PQputCopyData(rw->cxn, buf, len) == 1);
+        len = 0;
+    }
+
+    // trailer
+    if (ok)
+    {
+        appendCopyInt(&buf, &len, &cap, 2, -1);
+        ok = (PQputCopyData(rw->cxn, buf, len) == 1);
+    }
+
+    free((void *) buf);
+
+    if (PQputCopyEnd(rw->cxn, (ok ? NULL : "transcoder copy aborted")) != 1)
+        ok = false;
+
+    // check how the copy ended
+    while ((writeResult = PQgetResult(rw->cxn)) != NULL)
+    {
+        if (PQresultStatus(writeResult) != PGRES_COMMAND_OK)
+            ok = false;
+
+        PQclear(writeResult);
+    }
+
+    return ok;
+}
+
+// write the staged rows by copying them into the staging table and
+// applying them with one update, in a write transaction committed per
+// the commit policy, see commitDue().  if the copy or update fails, it
+// is rolled back and the rows are written one at a time so the failure
+// is put on the right row
+static void flushStaged(RowWriter* rw)
+{
+    PGresult *writeResult = NULL;
+    bool* updated = NULL;
+    bool ok = false;
+    int row = 0;
+    int i = 0;
+
+    if (rw->staged.size == 0)
+        return;
+
+    if (rw->applyQuery == NULL)
+        createStaging(rw);
+
+    sortRowsByCtid(rw, &rw->staged);
+
+    beginWrite(rw);
+
+    // empty what the previous flush in this transaction left
+    writeResult = pq_query(rw->cxn, "truncate " WRITER_STAGING_TABLE ";");
+    ok = (PQresultStatus(writeResult) == PGRES_COMMAND_OK);
+    PQclear(writeResult);
+
+    ok = ok && copyStaged(rw);
+
+    writeResult = NULL;
+
+    if (ok)
+    {
+        writeResult = pq_query(rw->cxn, rw->applyQuery);
+        ok = (PQresultStatus(writeResult) == PGRES_TUPLES_OK);
+    }
+
+    if (ok)
+    {
+        updated = calloc(rw->staged.size, sizeof(bool));
+
+        // row numbers of the rows updated
+        for (i = 0; i < PQntuples(writeResult); i++)
+        {
+            row = atoi(PQgetvalue(writeResult, i, 0)) - 1;
+
+            if (row >= 0 && row < rw->staged.size)
+                updated[row] = true;
+        }
+
+        for (row = 0; row < rw->staged.size; row++)
+        {
+            const PGRowResult* rowResult = rw->staged.data[row];
+
+            if (updated[row])
+            {
+                if (field.debug)
+                    LOGSTDOUT(DEBUG, PQresStatus(PQresultStatus(writeResult)),
+                        "%s.%s, %s=%s updated.\n",
+                        field.schema, field.table, rw->uniqueKeyCols, rowResult->ukValues);
+
+                countUpdated(rw);
+            }
+            else
+            {
+                notUpdated(rw, rowResult, PQresultStatus(writeResult));
+            }
+        }
+
+        free((void *) updated);
+
+        endWrite(rw, true);
+    }
+    else
+    {
+        LOGSTDERR(WARNING, PQerrorMessage(rw->cxn),
+            "Copy of %d staged rows of %s failed; writing them one at a time",
+            rw->staged.size, rw->fullTableName);
+
+        endWrite(rw, false);
+
+        for (row = 0; row < rw->staged.size; row++)
+            writeRow(rw, rw->staged.data[row]);
+    }
+
+    wroteRows(rw, rw->staged.size);
+
+    if (writeResult)
+        PQclear(writeResult);
+
+    // keep the vector for the next flush
+    vector_clear(&rw->staged);
+}
+
+void rowWriterOpen(RowWriter* rw, int write, PGconn* cxn,
+                   const char* fullTableName,
+                   const char* uniqueKeyCols,
+                   const char* uniqueKeyDataTypes,
+                   const char* rereadKeyCols,
+                   const Vector* cbColNames,
+                   unsigned long batchSize,
+                   unsigned long commitEvery,
+                   unsigned long commitInterval,
+                   bool asyncCommit,
+                   unsigned long pipelineDepth,
+                   bool optimistic,
+                   unsigned long lockTimeout,
+                   unsigned long statementTimeout)
+{
+    PGresult *writeResult = NULL;
+    Vector keyCols;
+
+    memset(rw, 0, sizeof(RowWriter));
+
+    rw->write         = write;
+    rw->cxn           = cxn;
+    rw->fullTableName = fullTableName;
+    rw->uniqueKeyCols = uniqueKeyCols;
+    rw->ctidKeyed     = (strcmp(uniqueKeyCols, CTID_KEY_COLS) == 0);
+    rw->rereadKeyCols = rereadKeyCols;
+    rw->cbColNames    = cbColNames;
+    rw->batchSize     = (batchSize > 0 ? batchSize : 1);
+    rw->commitEvery   = commitEvery;
+    rw->commitInterval = commitInterval;
+    rw->optimistic    = optimistic;
+    rw->applyQuery    = NULL;
+    rw->inTransaction = false;
+    rw->rowsUpdated   = 0;
+    rw->rowsFailed    = 0;
+
+    rw->keyColCount = splitString(&keyCols, uniqueKeyCols, ", ");
+    vector_free(&keyCols);
+
+    splitString(&rw->ukTypes, uniqueKeyDataTypes, ", ");
+    rw->ukParamList = constructUkParamList(uniqueKeyDataTypes);
+
+    vector_init(&rw->batches, "WriteBatch*", 0);
+    vector_init(&rw->writeStmts, "WriteStmt*", 0);
+    vector_init(&rw->staged, "PGRowResult*", (write == WRITE_COPY ? rw->batchSize : 0));
+    vector_init(&rw->conflicts, "PGRowResult*", 0);
+
+    // pipeline single row updates that commit on their own, if both
+    // libpq and the server are new enough
+#ifdef LIBPQ_HAS_PIPELINING
+    if (write == WRITE_UPDATE && rw->batchSize <= 1 && !useWriteTransactions(rw) &&
+        PQserverVersion(cxn) >= 140000)
+        rw->pipelineDepth = pipelineDepth;
+#endif
+
+    vector_init(&rw->pipelined, "PGRowResult*", rw->pipelineDepth);
+
+    // don't wait for the commit record to be flushed to disk.  a crash
+    // can lose the last commits, but never leaves a row half written,
+    // and the run can be restarted
+    if (asyncCommit)
+    {
+        writeResult = pq_query(rw->cxn, "set synchronous_commit to off;");
+
+        if (PQresultStatus(writeResult) != PGRES_COMMAND_OK)
+            LOGSTDERR(WARNING, PQerrorMessage(rw->cxn),
+                "Cannot turn off synchronous_commit for writes to %s", rw->fullTableName);
+
+        PQclear(writeResult);
+    }
+
+    // give up on a write that waits on a row an application holds, or
+    // runs too long, rather than stall the run; its rows are deferred
+    if (lockTimeout > 0)
+    {
+        writeResult = pq_vaquery(rw->cxn, "set lock_timeout = %lu;", lockTimeout);
+
+        if (PQresultStatus(writeResult) != PGRES_COMMAND_OK)
+            LOGSTDERR(WARNING, PQerrorMessage(rw->cxn),
+                "Cannot set lock_timeout for writes to %s", rw->fullTableName);
+
+        PQclear(writeResult);
+    }
+
+    if (statementTimeout > 0)
+    {
+        writeResult = pq_vaquery(rw->cxn, "set statement_timeout = %lu;", statementTimeout);
+
+        if (PQresultStatus(writeResult) != PGRES_COMMAND_OK)
+            LOGSTDERR(WARNING, PQerrorMessage(rw->cxn),
+                "Cannot set statement_timeout for writes to %s", rw->fullTableName);
+
+        PQclear(writeResult);
+    }
+}
+
+// write the converted values of a row, now or with the next batch of rows
+// that set the same columns, or with the next staging flush.  takes over
+// cols, which the caller must not use or free afterwards
+void rowWriterWrite(RowWriter* rw, const char* uniqueKeyValues,
+                    const Vector* ukTuple, const char* ctid,
+                    const char* xmin, const char* rereadKey, Vector* cols)
+{
+    PGRowResult* rowResult = NULL;
+    WriteBatch* wb = NULL;
+    char* signature = NULL;
+    int i = 0;
+
+    // don't hold --commit-interval's transaction open through a run of
+    // rows that didn't need writing
+    if (rw->commitInterval > 0 && commitDue(rw))
+        commitWrites(rw);
+
+    rowResult = newRowResult(uniqueKeyValues, ukTuple, ctid, xmin, rereadKey);
+
+    vector_free(&rowResult->cols);
+    rowResult->cols = *cols;
+
+    if (rw->write == WRITE_COPY)
+    {
+        vector_append(&rw->staged, (void *) rowResult);
+
+        if (rw->staged.size >= rw->batchSize)
+            flushStaged(rw);
+
+        return;
+    }
+
+    if (rw->pipelineDepth > 0)
+    {
+        vector_append(&rw->pipelined, (void *) rowResult);
+
+        if (rw->pipelined.size >= rw->pipelineDepth)
+            flushPipeline(rw);
+
+        return;
+    }
+
+    if (rw->batchSize <= 1)
+    {
+        writeRow(rw, rowResult);
+        wroteRows(rw, 1);
+        freeRowResult(rowResult);
+        return;
+    }
+
+    signature = constructColSignature(&rowResult->cols);
+
+    for (i = 0; i < rw->batches.size; i++)
+    {
+        if (strcmp(((WriteBatch*) rw->batches.data[i])->signature, signature) == 0)
+        {
+            wb = rw->batches.data[i];
+            break;
+        }
+    }
+
+    if (wb == NULL)
+    {
+        wb = malloc(sizeof(WriteBatch));
+        wb->signature = signature;
+        vector_init(&wb->rows, "PGRowResult*", rw->batchSize);
+        vector_append(&rw->batches, (void *) wb);
+    }
+    else
+    {
+        free((void *) signature);
+    }
+
+    vector_append(&wb->rows, (void *) rowResult);
+
+    if (wb->rows.size >= rw->batchSize)
+        flushBatch(rw, wb);
+}
+
+// write all the rows waiting in batches, staged or for the pipeline,
+// and commit them
+void rowWriterFlush(RowWriter* rw)
+{
+    int i = 0;
+
+    for (i = 0; i < rw->batches.size; i++)
+        flushBatch(rw, rw->batches.data[i]);
+
+    flushStaged(rw);
+    flushPipeline(rw);
+    commitWrites(rw);
+}
+
+// queue a row the caller found locked by another transaction, reading
+// it with --skip-locked, to be re-read with the others
+void rowWriterDefer(RowWriter* rw, const char* uniqueKeyValues, const Vector* ukTuple)
+{
+    deferRow(rw, uniqueKeyValues, ukTuple, "is locked by another transaction");
+}
+
+// write all the rows waiting, then hand the caller the keys of the rows
+// found changed since they were read under --optimistic, or deferred
+// after a lock or statement timeout, to re-read, convert and write again.
+// the caller frees them with vector_free().  returns how many there are
+unsigned int rowWriterTakeConflicts(RowWriter* rw, Vector* conflicts)
+{
+    rowWriterFlush(rw);
+
+    *conflicts = rw->conflicts;
+    vector_init(&rw->conflicts, "PGRowResult*", 0);
+
+    return conflicts->size;
+}
+
+void rowWriterClose(RowWriter* rw)
+{
+    int i = 0;
+
+    rowWriterFlush(rw);
+
+    // rows that were still changing or locked when the caller stopped
+    // re-reading them were never converted, so they fail the run
+    for (i = 0; i < rw->conflicts.size; i++)
+        LOGSTDOUT(ERROR, "CONFLICT",
+            "%s.%s, %s=%s kept changing or stayed locked; not updated.\n",
+            field.schema, field.table, queuedKeyCols(rw),
+            ((PGRowResult*) rw->conflicts.data[i])->ukValues);
+
+    rw->rowsFailed += rw->conflicts.size;
+    vector_free(&rw->conflicts);
+
+    for (i = 0; i < rw->batches.size; i++)
+    {
+        WriteBatch* wb = rw->batches.data[i];
+
+        vector_free(&wb->rows);
+        free((void *) wb->signature);
+    }
+
+    // frees the batches themselves
+    vector_free(&rw->batches);
+
+    for (i = 0; i < rw->writeStmts.size; i++)
+    {
+        WriteStmt* ws = rw->writeStmts.data[i];
+
+        free((void *) ws->signature);
+        free((void *) ws->name);
+    }
+
+    vector_free(&rw->writeStmts);
+    free((void *) rw->ukParamList);
+    vector_free(&rw->staged);
+    vector_free(&rw->pipelined);
+    vector_free(&rw->ukTypes);
+    free((void *) rw->applyQuery);
+
+    rw->applyQuery = NULL;
+    rw->ukParamList = NULL;
+}
@@ -0,0 +1,119 @@
+/*
+ * writer.h
+ *
+ * Row writers that send the converted character-based column values
+ * of many rows per update statement, or copy them into a staging table
+ *
+ * Copyright © 2015, AWeber Communications.
+ * All rights reserved.
+ */
+
+#ifndef _WRITER_H_
+#define _WRITER_H_
+
+#include <libpq-fe.h>
+#include <stdbool.h>
+#include <sys/time.h>
+
+#include "vector.h"
+#include "colresult.h"
+
+// alias of the values list joined to the table by a batch update, and
+// prefixes of its columns, chosen not to collide with the table's
+#define WRITER_VALUES_ALIAS  "transcoder_v"
+#define WRITER_ROW_COL       "transcoder_row"
+#define WRITER_KEY_COL       "transcoder_uk"
+#define WRITER_VALUE_COL     "transcoder_val"
+
+// columns of the values list and staging table holding the ctid and
+// xmin a row was read with, checked by --optimistic writes
+#define WRITER_CTID_COL      "transcoder_ctid"
+#define WRITER_XMIN_COL      "transcoder_xmin"
+
+// session-local table --write=copy copies converted rows into before
+// applying them with one update per flush
+#define WRITER_STAGING_TABLE "transcoder_staging"
+
+// prefix of the staging columns flagging which values a row sets, since
+// with --skip-ascii-columns rows set different columns
+#define WRITER_SET_COL       "transcoder_set"
+
+// savepoint set around each update statement or staging flush in a write
+// transaction, so a failed one doesn't roll back the others
+#define WRITER_SAVEPOINT     "transcoder_write"
+
+// prefix of the names of the updates prepared for single rows, one per
+// set of columns written
+#define WRITE_STMT_PREFIX    "transcoder_write_"
+
+typedef struct
+{
+    char*           signature;      // comma separated names of the columns the rows set
+    Vector          rows;           // PGRowResult* waiting to be written
+} WriteBatch;
+
+typedef struct
+{
+    char*           signature;      // comma separated names of the columns the update sets
+    char*           name;           // prepared statement name, WRITE_STMT_PREFIX<n>
+} WriteStmt;
+
+typedef struct
+{
+    int             write;          // WRITE_UPDATE or WRITE_COPY, see --write
+    PGconn*         cxn;            // write connection
+    const char*     fullTableName;  // schema-qualified table name
+    const char*     uniqueKeyCols;  // shortest unique key column(s), comma separated
+    bool            ctidKeyed;      // rows are found by ctid and xmin, see --scan=ctid
+    const char*     rereadKeyCols;  // under --scan=ctid, the unique key rows are re-read by; NULL if none
+    Vector          ukTypes;        // data type of each unique key column
+    char*           ukParamList;    // "$1::<type>, ..." for the unique key, see constructUkParamList()
+    int             keyColCount;    // columns in uniqueKeyCols
+    const Vector*   cbColNames;     // character-based column names, one staging column each
+    unsigned long   batchSize;      // rows per update statement, or per staging flush, see --write-batch-size
+    unsigned long   commitEvery;    // rows per write transaction, see --commit-every; 0 for no row limit
+    unsigned long   commitInterval; // milliseconds per write transaction, see --commit-interval; 0 for no time limit
+    Vector          batches;        // WriteBatch* of rows waiting to be written, one per set of columns
+    Vector          writeStmts;     // WriteStmt* prepared for single rows, one per set of columns
+    Vector          staged;         // PGRowResult* waiting for the next staging flush
+    unsigned long   pipelineDepth;  // single row updates sent per pipeline, see --pipeline-depth; 0 for no pipeline
+    Vector          pipelined;      // PGRowResult* waiting to be sent down the pipeline
+    bool            optimistic;     // only update rows still at the ctid and xmin they were read with, see --optimistic
+    Vector          conflicts;      // PGRowResult* keys of rows changed since they were read, or locked, to be re-read
+    char*           applyQuery;     // update from WRITER_STAGING_TABLE; NULL until the table is created
+    bool            inTransaction;  // an explicit write transaction is open, see commitDue()
+    struct timeval  txnStart;       // when the open write transaction began
+    unsigned long   rowsSinceCommit;// rows written in the open transaction
+    unsigned long   uncommitted;    // rows counted as updated in the open transaction
+    unsigned long   rowsUpdated;    // rows written
+    unsigned long   rowsFailed;     // rows whose update failed
+} RowWriter;
+
+void rowWriterOpen(RowWriter* rw, int write, PGconn* cxn,
+                   const char* fullTableName,
+                   const char* uniqueKeyCols,
+                   const char* uniqueKeyDataTypes,
+                   const char* rereadKeyCols,
+                   const Vector* cbColNames,
+                   unsigned long batchSize,
+                   unsigned long commitEvery,
+                   unsigned long commitInterval,
+                   bool asyncCommit,
+                   unsigned long pipelineDepth,
+                   bool optimistic,
+                   unsigned long lockTimeout,
+                   unsigned long statementTimeout);
+
+void rowWriterWrite(RowWriter* rw, const char* uniqueKeyValues,
+                    const Vector* ukTuple, const char* ctid,
+                    const char* xmin, const char* rereadKey, Vector* cols);
+
+void rowWriterFlush(RowWriter* rw);
+
+void rowWriterDefer(RowWriter* rw, const char* uniqueKeyValues, const Vector* ukTuple);
+
+unsigned int rowWriterTakeConflicts(RowWriter* rw, Vector* conflicts);
+
+void rowWriterClose(RowWriter* rw);
+
+#endif // #ifndef _WRITER_H_